@@ -0,0 +1,56 @@
+#!/bin/bash
+# Options: 1:stat_file 2:dictionary 3:thresholds 4:min_length 5:max_length
+#
+# Compare default and prefix-major enumeration order of passwords. Every
+# configuration is run in both orders, they have to crack the same number
+# of passwords.
+
+# stat dict thresholds min max mode
+function run_order
+{
+  stat=$1
+  dict=$2
+  thr=$3
+  min=$4
+  max=$5
+  mode=$6
+  models="classic layered"
+
+  for mod in $models; do
+    expected=""
+    for order in "" "--prefix-major"; do
+      start=$(date +%s.%N)
+      cracked=$(./clMarkovGen -s "stats/$stat.wstat" -d "cache/$dict.widx" -t $thr -l "$min:$max" -g 10240000 -M $mod --model-cache cache $mode $order | grep "Cracked passwords")
+      stop=$(date +%s.%N)
+
+      seconds=$(awk "BEGIN { print $stop - $start }")
+      echo "$mod, ${mode:-separate kernels}, ${order:-default order}: $seconds s, $cracked"
+
+      # Default order is run first, prefix-major has to crack the same
+      if [ -z "$expected" ]; then
+        expected=$cracked
+      elif [ "$cracked" != "$expected" ]; then
+        echo "Mismatch: default order '$expected', prefix-major '$cracked'"
+        exit 1
+      fi
+    done
+  done
+}
+
+stat=$1
+dict=$2
+thresholds=$3
+min=$4
+max=$5
+
+mkdir -p cache
+
+# Hash table of dictionary is built once for all runs
+if [ ! -f "cache/$dict.widx" ]
+then
+  ./clMarkovGen -d "dictionaries/$dict.dic" index "cache/$dict.widx"
+fi
+
+for mode in "" "--per-item 16" "--fused --per-item 16" "--persistent --per-item 16"; do
+  run_order $stat $dict "$thresholds" $min $max "$mode"
+done
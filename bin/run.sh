@@ -18,7 +18,7 @@ function run_simple
       echo "$mod $thr"
       if [ ! -f "results/$stat-$dict/$out_file" ]
       then
-        ./clMarkovGen -s "stats/$stat.wstat" -d "dictionaries/$dict.dic" -t $thr -l "$min:$max" -g 10240000 -M $mod -p > "results/$stat-$dict/$out_file"
+        ./clMarkovGen -s "stats/$stat.wstat" -d "cache/$dict.widx" -t $thr -l "$min:$max" -g 10240000 -M $mod --model-cache cache -p > "results/$stat-$dict/$out_file"
       fi
     done
   done
@@ -41,7 +41,7 @@ function run_comp {
         echo "$mod $thr:$lim"
         if [ ! -f "results/$stat-$dict/$out_file" ]
         then
-          ./clMarkovGen -s "stats/$stat.wstat" -d "dictionaries/$dict.dic" -t "$thr:$lim" -l "$min:$max" -g 10240000 -M $mod -p > "results/$stat-$dict/$out_file"
+          ./clMarkovGen -s "stats/$stat.wstat" -d "cache/$dict.widx" -t "$thr:$lim" -l "$min:$max" -g 10240000 -M $mod --model-cache cache -p > "results/$stat-$dict/$out_file"
         fi
       done
     done
@@ -54,6 +54,13 @@ min=$3
 max=$4
 
 mkdir "results/$stat-$dict"
+mkdir -p cache
+
+# Hash table of dictionary is built once for all runs
+if [ ! -f "cache/$dict.widx" ]
+then
+  ./clMarkovGen -d "dictionaries/$dict.dic" index "cache/$dict.widx"
+fi
 
 if [ $max -le 8 ]
 then
@@ -25,39 +25,55 @@
 
 #include <CLMarkovPassGen.h>
 
+#include "PassSlot.h"
+
 #ifdef _WIN32
 #include <winsock2.h>
+#include <process.h>       // getpid
 #else
 #include <arpa/inet.h>     // ntohl, ntohs
+#include <unistd.h>        // getpid
 #endif
-#include <cstdlib>         // atoi, qsort
+#include <cstdlib>         // atoi
+#include <cstring>         // memcpy, memcmp
+#include <cstdio>          // rename, remove
 
 #include <sstream>
+#include <iomanip>
 #include <string>
 #include <stdexcept>
 #include <iostream>
 #include <limits>
 #include <vector>
-#include <algorithm>       // max_element
+#include <algorithm>       // max_element, find, sort, partial_sort
+#include <thread>
+#include <cmath>           // ceil
 
 using namespace std;
 
 
+void CLMarkovPassGen::SetDeviceGroups(unsigned num_groups)
+{
+  if (num_groups == 0)
+    throw invalid_argument("Invalid number of device groups");
+
+  _num_groups = num_groups;
+}
+
 void CLMarkovPassGen::InitKernel(std::vector<cl::Kernel>& kernels,
                                  std::vector<cl::CommandQueue>& queues,
-                                 cl::Context& context)
+                                 cl::Context& context, unsigned first_arg)
 {
   _kernels = kernels;
+  _first_arg = first_arg;
+
+  initIndexes(kernels.size());
 
   for (int dev_num = 0; dev_num < kernels.size(); dev_num++)
   {
     cl::Kernel & kernel = kernels[dev_num];
     cl::CommandQueue & queue = queues[dev_num];
 
-    // Invalid values to prevent kernel execution without reserved passwords
-    _local_start_indexes.push_back(1);
-    _local_stop_indexes.push_back(0);
-
     cl::Buffer markov_table_buffer { context, CL_MEM_READ_ONLY,
         _markov_table_size * sizeof(cl_uchar) };
     queue.enqueueWriteBuffer(markov_table_buffer, CL_TRUE, 0,
@@ -78,20 +94,30 @@ void CLMarkovPassGen::InitKernel(std::vector<cl::Kernel>& kernels,
                              _permutations);
     _permutations_buffer.push_back(permutations_buffer);
 
-    kernel.setArg(2, markov_table_buffer);
-    kernel.setArg(3, thresholds_buffer);
-    kernel.setArg(4, permutations_buffer);
-    kernel.setArg(5, _max_threshold);
-    kernel.setArg(6, _local_start_indexes[dev_num]);
-    kernel.setArg(7, _local_stop_indexes[dev_num]);
+    kernel.setArg(first_arg, markov_table_buffer);
+    kernel.setArg(first_arg + 1, thresholds_buffer);
+    kernel.setArg(first_arg + 2, permutations_buffer);
+    kernel.setArg(first_arg + 3, _max_threshold);
+    kernel.setArg(first_arg + 4, _min_length);
+    kernel.setArg(first_arg + 5, _local_start_indexes[dev_num]);
+    kernel.setArg(first_arg + 6, _local_stop_indexes[dev_num]);
+    kernel.setArg(first_arg + 7, _sweep_from);
+
+    if (_per_item > 1)
+      kernel.setArg(first_arg + 8, _per_item);
   }
 
   freeUnusedMemory();
 }
 
 CLMarkovPassGen::CLMarkovPassGen(Options & options) :
-    _mask { options.mask }, _stat_file { options.stat_file }
+    _mask { options.mask }, _stat_file { options.stat_file },
+    _mask_string { options.mask }, _model_cache { options.model_cache },
+    _prefix_major { options.prefix_major }, _per_item { options.per_item }
 {
+  if (_per_item == 0)
+    throw invalid_argument("Invalid value for argument 'per-item'");
+
   _thresholds = new cl_uint[MAX_PASS_LENGTH];
   _permutations = new cl_ulong[MAX_PASS_LENGTH + 1];
 
@@ -100,17 +126,43 @@ CLMarkovPassGen::CLMarkovPassGen(Options & options) :
   // Determine maximal threshold
   _max_threshold = *max_element(_thresholds, _thresholds + MAX_PASS_LENGTH);
 
-  // Initialize memory
-  initMemory();
+  // Initialize memory, use cached model if it's available
+  if (_model_cache.empty())
+  {
+    initMemory();
+  }
+  else
+  {
+    uint64_t key = modelKey();
+    string path = modelCachePath(key);
+
+    if (!loadModelCache(path, key))
+    {
+      initMemory();
+      storeModelCache(path, key);
+    }
+  }
 
-  _global_start_index = _permutations[_min_length - 1];
+  _global_first_index = _permutations[_min_length - 1];
   _global_stop_index = _permutations[_max_length];
+  _length_indexes.assign(_permutations, _permutations + MAX_PASS_LENGTH + 1);
 
   Details();
 }
 
 CLMarkovPassGen::~CLMarkovPassGen()
 {
+  freeUnusedMemory();
+}
+
+cl_ulong CLMarkovPassGen::FirstIndex()
+{
+  return _global_first_index;
+}
+
+unsigned CLMarkovPassGen::MinPasswordLength()
+{
+  return _min_length;
 }
 
 unsigned CLMarkovPassGen::MaxPasswordLength()
@@ -118,26 +170,62 @@ unsigned CLMarkovPassGen::MaxPasswordLength()
   return _max_length;
 }
 
-int CLMarkovPassGen::compareSortElements(const void* p1, const void* p2)
+bool CLMarkovPassGen::GuessNumber(const cl_uchar *password, unsigned length,
+                                  cl_ulong & guess_number, unsigned & rank)
 {
-  const SortElement *e1 = static_cast<const SortElement *>(p1);
-  const SortElement *e2 = static_cast<const SortElement *>(p2);
+  if (length < _min_length || length > _max_length)
+    return false;
 
-  if (!isValidChar(e1->next_state) && isValidChar(e2->next_state))
-    return (1);
+  cl_ulong index = 0;
+  cl_ulong radix = 1;
+  cl_uchar last_char = 0;
+  rank = 0;
 
-  if (isValidChar(e1->next_state) && !isValidChar(e2->next_state))
-	  return (-1);
+  // Find rank of every character in the row of its predecessor
+  for (unsigned p = 0; p < length; p++)
+  {
+    const cl_uchar *row = &_markov_table[rowOffset(p, last_char)];
+    const cl_uchar *row_end = row + _thresholds[p];
+    const cl_uchar *position = find(row, row_end, password[p]);
 
-  if (!isValidChar(e1->next_state) && !isValidChar(e2->next_state))
-    return (e2->next_state - e1->next_state);
+    if (position == row_end)
+      return false;
 
-  int result = e2->probability - e1->probability;
+    if (_prefix_major)
+    {
+      index = index * _thresholds[p] + (position - row);
+    }
+    else
+    {
+      index += (position - row) * radix;
+      radix *= _thresholds[p];
+    }
+    last_char = password[p];
 
-  if (result == 0)
-    return (e2->next_state - e1->next_state);
+    if (p >= _sweep_from && position - row > rank)
+      rank = position - row;
+  }
 
-  return (result);
+  guess_number = _permutations[length - 1] + index;
+  return true;
+}
+
+const std::vector<unsigned> & CLMarkovPassGen::SweepThresholds()
+{
+  return _sweep_thresholds;
+}
+
+bool CLMarkovPassGen::compareSortElements(const SortElement & e1,
+                                          const SortElement & e2)
+{
+  // Valid characters first, then by descending probability and character
+  if (isValidChar(e1.next_state) != isValidChar(e2.next_state))
+    return isValidChar(e1.next_state);
+
+  if (isValidChar(e1.next_state) && e1.probability != e2.probability)
+    return (e1.probability > e2.probability);
+
+  return (e1.next_state > e2.next_state);
 }
 
 void CLMarkovPassGen::parseOptions(Options & options)
@@ -160,9 +248,27 @@ void CLMarkovPassGen::parseOptions(Options & options)
 
   // Set global threshold
   std::getline(ss, substr, ':');
+  unsigned global_threshold = stoi(substr);
+
+  // In sweep mode, generate with the largest of the swept thresholds
+  if (!options.sweep.empty())
+  {
+    stringstream sweep_ss { options.sweep };
+    while (std::getline(sweep_ss, substr, ','))
+    {
+      _sweep_thresholds.push_back(stoi(substr));
+    }
+
+    sort(_sweep_thresholds.begin(), _sweep_thresholds.end());
+    global_threshold = _sweep_thresholds.back();
+
+    if (global_threshold > MAX_SWEEP_THRESHOLD)
+      throw invalid_argument("Invalid value for argument 'sweep'");
+  }
+
   for (int i = 0; i < MAX_PASS_LENGTH; i++)
   {
-    _thresholds[i] = stoi(substr);
+    _thresholds[i] = global_threshold;
   }
 
   // Adjust threshold values according to mask
@@ -181,6 +287,7 @@ void CLMarkovPassGen::parseOptions(Options & options)
     _thresholds[i] = stoi(substr);
     i++;
   }
+  _sweep_from = i;
 
   // Parse model
   if (options.model == "classic")
@@ -190,6 +297,14 @@ void CLMarkovPassGen::parseOptions(Options & options)
   else
     throw invalid_argument("Invalid value for argument 'model'");
 
+  // Rows of classic model differ only by mask
+  _single_layer = (_model == Model::CLASSIC);
+  for (unsigned p = 1; p < _max_length; p++)
+  {
+    if (!(_mask[p] == _mask[0]))
+      _single_layer = false;
+  }
+
 }
 
 void CLMarkovPassGen::initMemory()
@@ -201,107 +316,230 @@ void CLMarkovPassGen::initMemory()
     _permutations[i] = _permutations[i - 1] + numPermutations(i);
   }
 
-  // Open file with statistics and find appropriate statistics
-  ifstream input { _stat_file, ifstream::in | ifstream::binary };
-  unsigned stat_length = findStatistics(input);
+  // Map file with statistics and find section of the model
+  MappedFile stat_file { _stat_file };
+  uint32_t stat_length;
+  const uint8_t *statistics = findStatistics(stat_file, stat_length);
 
-  // Create Markov matrix from statistics
-  const unsigned markov_matrix_size = CHARSET_SIZE * CHARSET_SIZE
-      * MAX_PASS_LENGTH;
-  uint16_t *markov_matrix_buffer = new uint16_t[markov_matrix_size];
-  uint16_t *markov_matrix[MAX_PASS_LENGTH][CHARSET_SIZE];
-  auto markov_matrix_ptr = markov_matrix_buffer;
+  // Layered model without statistics for some positions
+  const unsigned layer_size = CHARSET_SIZE * CHARSET_SIZE * sizeof(uint16_t);
+  unsigned num_layers = stat_length / layer_size;
+  vector<uint8_t> padded_statistics;
 
-  for (int p = 0; p < MAX_PASS_LENGTH; p++)
+  if (_model == Model::LAYERED && num_layers < _max_length)
   {
-    for (int i = 0; i < CHARSET_SIZE; i++)
+    padded_statistics.assign(statistics, statistics + num_layers * layer_size);
+    padded_statistics.resize(_max_length * layer_size, 0);
+    statistics = padded_statistics.data();
+  }
+  else if (num_layers == 0)
+  {
+    throw runtime_error { "File contains incomplete statistics" };
+  }
+
+  unsigned num_positions = _single_layer ? 1 : _max_length;
+  _markov_table_size = num_positions * CHARSET_SIZE * _max_threshold;
+  _markov_table = new cl_uchar[_markov_table_size];
+
+  // Classic model has the same rows on all positions with the same mask,
+  // these positions are copied instead of being built again
+  vector<unsigned> source_position(num_positions);
+  vector<unsigned> built_positions;
+
+  for (unsigned p = 0; p < num_positions; p++)
+  {
+    if (_model == Model::CLASSIC && p > 0 && _mask[p] == _mask[p - 1])
     {
-      markov_matrix[p][i] = markov_matrix_ptr;
-      markov_matrix_ptr += CHARSET_SIZE;
+      source_position[p] = source_position[p - 1];
+    }
+    else
+    {
+      source_position[p] = p;
+      built_positions.push_back(p);
     }
   }
 
-  input.read(reinterpret_cast<char *>(markov_matrix_buffer), stat_length);
+  // Build rows in parallel
+  unsigned num_rows = built_positions.size() * CHARSET_SIZE;
+  unsigned num_threads = min(max(thread::hardware_concurrency(), 1u), num_rows);
+  vector<thread> threads;
 
-  // In case of classic Markov model, copy statistics to all positions
-  if (_model == Model::CLASSIC)
+  for (unsigned t = 0; t < num_threads; t++)
   {
-    markov_matrix_ptr = markov_matrix_buffer;
-    for (int p = 1; p < MAX_PASS_LENGTH; p++)
+    threads.push_back(thread { [&, t] ()
     {
-      markov_matrix_ptr += CHARSET_SIZE * CHARSET_SIZE;
+      for (unsigned row = t; row < num_rows; row += num_threads)
+      {
+        buildRow(statistics, built_positions[row / CHARSET_SIZE],
+                 row % CHARSET_SIZE);
+      }
+    } });
+  }
 
-      memcpy(markov_matrix_ptr, markov_matrix_buffer,
-             CHARSET_SIZE * CHARSET_SIZE * sizeof(uint16_t));
-    }
+  for (auto &i : threads)
+  {
+    i.join();
   }
 
-  // Convert these values to host byte order
-  for (int i = 0; i < markov_matrix_size; i++)
+  const unsigned position_size = CHARSET_SIZE * _max_threshold;
+  for (unsigned p = 0; p < num_positions; p++)
   {
-    markov_matrix_buffer[i] = ntohs(markov_matrix_buffer[i]);
+    if (source_position[p] != p)
+      memcpy(&_markov_table[p * position_size],
+             &_markov_table[source_position[p] * position_size],
+             position_size);
   }
+}
 
-  // Create temporary Markov table to order elements
-  SortElement *markov_sort_table_buffer = new SortElement[markov_matrix_size];
-  SortElement *markov_sort_table[MAX_PASS_LENGTH][CHARSET_SIZE];
-  auto markov_sort_table_ptr = markov_sort_table_buffer;
+void CLMarkovPassGen::buildRow(const uint8_t *statistics, unsigned position,
+                               unsigned last_char)
+{
+  const unsigned layer = (_model == Model::CLASSIC) ? 0 : position;
+  const uint8_t *row_stats = statistics
+      + (layer * CHARSET_SIZE + last_char) * CHARSET_SIZE * sizeof(uint16_t);
+  const MaskElement & mask = _mask[position];
+  SortElement row[CHARSET_SIZE];
 
-  for (int p = 0; p < MAX_PASS_LENGTH; p++)
+  for (unsigned j = 0; j < CHARSET_SIZE; j++)
   {
-    for (int i = 0; i < CHARSET_SIZE; i++)
-    {
-      markov_sort_table[p][i] = markov_sort_table_ptr;
-      markov_sort_table_ptr += CHARSET_SIZE;
-    }
+    // Statistics are stored in network byte order
+    row[j].next_state = static_cast<uint8_t>(j);
+    row[j].probability = (row_stats[2 * j] << 8) | row_stats[2 * j + 1];
+
+    // Characters satisfying mask take precedence
+    if (mask.Satisfy(j))
+      row[j].probability += UINT16_MAX + 1;
   }
 
-  for (int p = 0; p < MAX_PASS_LENGTH; p++)
+  // Only first max_threshold characters are needed
+  partial_sort(row, row + _max_threshold, row + CHARSET_SIZE,
+               compareSortElements);
+
+  cl_uchar *table_row = &_markov_table[rowOffset(position, last_char)];
+  for (unsigned j = 0; j < _max_threshold; j++)
   {
-    for (int i = 0; i < CHARSET_SIZE; i++)
-    {
-      for (int j = 0; j < CHARSET_SIZE; j++)
-      {
-        markov_sort_table[p][i][j].next_state = static_cast<uint8_t>(j);
-        markov_sort_table[p][i][j].probability = markov_matrix[p][i][j];
-      }
-    }
+    table_row[j] = row[j].next_state;
   }
+}
 
-  // Apply mask
-  applyMask(markov_sort_table);
+unsigned CLMarkovPassGen::rowOffset(unsigned position, unsigned last_char)
+{
+  unsigned layer = _single_layer ? 0 : position;
 
-  // Order elements by probability
-  for (int p = 0; p < MAX_PASS_LENGTH; p++)
+  return (layer * CHARSET_SIZE + last_char) * _max_threshold;
+}
+
+uint64_t CLMarkovPassGen::modelKey()
+{
+  // 64-bit FNV-1a of statistics and all options affecting the tables
+  const uint64_t fnv_prime = 1099511628211ull;
+  uint64_t key = 14695981039346656037ull;
+
+  auto add = [&key, fnv_prime] (const uint8_t *data, size_t size)
   {
-    for (int i = 0; i < CHARSET_SIZE; i++)
-    {
-      qsort(markov_sort_table[p][i], CHARSET_SIZE, sizeof(SortElement),
-            compareSortElements);
-    }
-  }
+    for (size_t i = 0; i < size; i++)
+      key = (key ^ data[i]) * fnv_prime;
+  };
 
-  // Create final Markov table
-  _markov_table_size = _max_length * CHARSET_SIZE * _max_threshold;
-  _markov_table = new cl_uchar[_markov_table_size];
+  MappedFile stat_file { _stat_file };
+  add(stat_file.Data(), stat_file.Size());
 
-  unsigned index, index1, index2;
-  for (unsigned p = 0; p < _max_length; p++)
+  stringstream params;
+  params << _model << ":" << _mask_string << ":" << _min_length << ":"
+         << _max_length;
+  for (unsigned p = 0; p < MAX_PASS_LENGTH; p++)
+    params << ":" << _thresholds[p];
+
+  string params_str = params.str();
+  add(reinterpret_cast<const uint8_t *>(params_str.data()), params_str.size());
+
+  return key;
+}
+
+std::string CLMarkovPassGen::modelCachePath(uint64_t key)
+{
+  stringstream path;
+  path << _model_cache << "/" << hex << setw(16) << setfill('0') << key
+       << ".wmodel";
+
+  return path.str();
+}
+
+bool CLMarkovPassGen::loadModelCache(const std::string & path, uint64_t key)
+{
+  unique_ptr<MappedFile> cache_file;
+
+  try
   {
-    index1 = p * CHARSET_SIZE * _max_threshold;
-    for (unsigned i = 0; i < CHARSET_SIZE; i++)
-    {
-      index2 = i * _max_threshold;
-      for (unsigned j = 0; j < _max_threshold; j++)
-      {
-        index = index1 + index2 + j;
-        _markov_table[index] = markov_sort_table[p][i][j].next_state;
-      }
-    }
+    cache_file.reset(new MappedFile { path });
   }
+  catch (runtime_error &)
+  {
+    return false;
+  }
+
+  // Validate header, cache made by other version is ignored
+  ModelCacheHeader header;
+  size_t tables_size = (MAX_PASS_LENGTH + 1) * sizeof(cl_ulong)
+      + MAX_PASS_LENGTH * sizeof(cl_uint);
+
+  if (cache_file->Size() < sizeof(header) + tables_size)
+    return false;
+
+  memcpy(&header, cache_file->Data(), sizeof(header));
+
+  if (memcmp(header.magic, _model_cache_magic, sizeof(header.magic)) != 0
+      || header.key != key || header.max_length != _max_length
+      || header.max_threshold != _max_threshold
+      || cache_file->Size() != sizeof(header) + tables_size
+          + header.markov_table_size)
+    return false;
+
+  // Tables point directly into mapped file
+  const uint8_t *data = cache_file->Data() + sizeof(header);
+
+  delete[] _permutations;
+  _permutations = reinterpret_cast<cl_ulong *>(const_cast<uint8_t *>(data));
+  data += (MAX_PASS_LENGTH + 1) * sizeof(cl_ulong);
+
+  delete[] _thresholds;
+  _thresholds = reinterpret_cast<cl_uint *>(const_cast<uint8_t *>(data));
+  data += MAX_PASS_LENGTH * sizeof(cl_uint);
+
+  _markov_table = const_cast<cl_uchar *>(data);
+  _markov_table_size = header.markov_table_size;
+
+  _model_cache_file = move(cache_file);
+  return true;
+}
 
-  delete[] markov_matrix_buffer;
-  delete[] markov_sort_table_buffer;
+void CLMarkovPassGen::storeModelCache(const std::string & path, uint64_t key)
+{
+  ModelCacheHeader header { };
+  memcpy(header.magic, _model_cache_magic, sizeof(header.magic));
+  header.key = key;
+  header.max_length = _max_length;
+  header.max_threshold = _max_threshold;
+  header.markov_table_size = _markov_table_size;
+
+  // Write to temporary file first, concurrent runs can share the cache
+  string tmp_path = path + ".tmp" + to_string(getpid());
+  ofstream output { tmp_path, ofstream::out | ofstream::binary };
+
+  output.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  output.write(reinterpret_cast<const char *>(_permutations),
+               (MAX_PASS_LENGTH + 1) * sizeof(cl_ulong));
+  output.write(reinterpret_cast<const char *>(_thresholds),
+               MAX_PASS_LENGTH * sizeof(cl_uint));
+  output.write(reinterpret_cast<const char *>(_markov_table),
+               _markov_table_size);
+  output.close();
+
+  if (!output || rename(tmp_path.c_str(), path.c_str()) != 0)
+  {
+    remove(tmp_path.c_str());
+    cerr << "Unable to write model cache: " << path << endl;
+  }
 }
 
 bool CLMarkovPassGen::isValidChar(uint8_t value)
@@ -322,47 +560,42 @@ uint64_t CLMarkovPassGen::numPermutations(const unsigned length)
   return (result);
 }
 
-unsigned CLMarkovPassGen::findStatistics(std::ifstream& stat_file)
+const uint8_t * CLMarkovPassGen::findStatistics(const MappedFile & stat_file,
+                                                uint32_t & length)
 {
+  const uint8_t *data = stat_file.Data();
+  const uint8_t *end = data + stat_file.Size();
+
   // Skip header
-  stat_file.ignore(numeric_limits<streamsize>::max(), ETX);
+  data = find(data, end, ETX);
+  if (data != end)
+    data++;
 
   uint8_t type;
-  uint32_t length;
 
-  while (stat_file)
+  while (data <= end
+         && (size_t) (end - data) >= sizeof(type) + sizeof(length))
   {
-    stat_file.read(reinterpret_cast<char *>(&type), sizeof(type));
-    stat_file.read(reinterpret_cast<char *>(&length), sizeof(length));
+    type = *data;
+    memcpy(&length, data + sizeof(type), sizeof(length));
     length = ntohl(length);
+    data += sizeof(type) + sizeof(length);
+
+    if (length > (size_t) (end - data))
+      break;
 
     if (type == _model)
     {
-      return (length);
+      return (data);
     }
 
-    stat_file.ignore(length);
+    data += length;
   }
 
   throw runtime_error {
       "File doesn't contain statistics for specified Markov model" };
 }
 
-void CLMarkovPassGen::applyMask(SortElement* table[MAX_PASS_LENGTH][CHARSET_SIZE])
-{
-  for (unsigned p = 0; p < _max_length; p++)
-  {
-    for (unsigned i = 0; i < CHARSET_SIZE; i++)
-    {
-      for (unsigned j = 0; j < CHARSET_SIZE; j++)
-      {
-        if (_mask[p].Satisfy(table[p][i][j].next_state))
-          table[p][i][j].probability += UINT16_MAX + 1;
-      }
-    }
-  }
-}
-
 void CLMarkovPassGen::Details()
 {
 #ifndef NDEBUG
@@ -394,8 +627,61 @@ std::string CLMarkovPassGen::GetKernelSource()
   return (_kernel_source);
 }
 
+std::string CLMarkovPassGen::GetBuildOptions(
+    const std::vector<cl::Device> & devices, bool specialize)
+{
+  stringstream options;
+
+  // Order changes meaning of global index and layout of Markov table
+  // differs by model, so they are always baked in
+  if (_prefix_major)
+    options << " -DPREFIX_MAJOR";
+  if (_single_layer)
+    options << " -DSINGLE_LAYER";
+
+  // Table shares constant memory with thresholds and permutations
+  if (_single_layer)
+  {
+    size_t constant_size = _markov_table_size * sizeof(cl_uchar)
+        + _max_length * sizeof(cl_uint) + (_max_length + 2) * sizeof(cl_ulong);
+    if (specialize && _max_length <= _max_specialized_length)
+      constant_size += _max_length * sizeof(cl_uint);
+
+    bool fits = true;
+    for (auto & device : devices)
+    {
+      if (device.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>() < constant_size)
+        fits = false;
+    }
+
+    if (fits)
+      options << " -DSINGLE_LAYER_CONSTANT";
+  }
+
+  if (!specialize)
+    return (options.str());
+
+  options << " -DSPEC_MAX_THRESHOLD=" << _max_threshold;
+
+  // Unrolled loops and constant thresholds only for reasonable lengths
+  if (_max_length <= _max_specialized_length)
+  {
+    options << " -DSPEC_MAX_LENGTH=" << _max_length;
+    options << " -DSPEC_THRESHOLDS=";
+    for (unsigned p = 0; p < _max_length; p++)
+    {
+      options << (p > 0 ? "," : "") << _thresholds[p];
+    }
+  }
+
+  return (options.str());
+}
+
 std::string CLMarkovPassGen::GetKernelName()
 {
+  if (_per_item > 1)
+    return (_kernel_name_multi);
+
   return (_kernel_name);
 }
 
@@ -409,8 +695,7 @@ void CLMarkovPassGen::printMarkovTable()
       for (unsigned j = 0; j < _thresholds[p]; j++)
       {
         char c;
-        c = _markov_table[p * CHARSET_SIZE * _max_threshold + i * _max_threshold
-            + j];
+        c = _markov_table[rowOffset(p, i) + j];
 
         cout << c;
       }
@@ -422,50 +707,353 @@ void CLMarkovPassGen::printMarkovTable()
 void CLMarkovPassGen::SetGWS(std::size_t gws)
 {
   _gws = gws;
-  _resevation_size = 10000 * _gws;
+  _steps.assign(MAX_PASS_LENGTH + 1, _gws * _per_item);
+}
+
+void CLMarkovPassGen::SetBufferSize(std::size_t size)
+{
+  _steps.assign(MAX_PASS_LENGTH + 1, 0);
+  for (unsigned length = 1; length <= MAX_PASS_LENGTH; length++)
+  {
+    size_t num_items = size / (PASS_SLOT_SIZE(length) * _per_item);
+    _steps[length] = max<size_t>(1, num_items) * _per_item;
+  }
+}
+
+unsigned CLMarkovPassGen::CandidatesPerItem()
+{
+  return _per_item;
 }
 
 bool CLMarkovPassGen::NextKernelStep(unsigned device_number)
 {
-  if (_local_start_indexes[device_number] < _local_stop_indexes[device_number])
+  cl_ulong start, stop;
+
+  if (!nextStep(device_number, start, stop))
+    return false;
+
+  setKernelRange(device_number, start, stop);
+  return true;
+}
+
+cl_ulong CLMarkovPassGen::StepStart(unsigned device_number)
+{
+  lock_guard<mutex> lock { _local_index_mutex[device_number] };
+  return _local_start_indexes[device_number];
+}
+
+unsigned CLMarkovPassGen::StepLength(unsigned device_number)
+{
+  return lengthOf(StepStart(device_number));
+}
+
+cl_ulong CLMarkovPassGen::StepSize(unsigned device_number)
+{
+  return stepAt(StepStart(device_number));
+}
+
+bool CLMarkovPassGen::NextKernelRange(unsigned device_number)
+{
+  cl_ulong start, stop;
+
+  if (!nextStep(device_number, start, stop, true))
+    return false;
+
+  setKernelRange(device_number, start, stop);
+  return true;
+}
+
+void CLMarkovPassGen::InitHost(unsigned num_threads)
+{
+  initIndexes(num_threads);
+}
+
+bool CLMarkovPassGen::NextHostStep(unsigned thread_number, cl_ulong & start,
+                                   cl_ulong & stop)
+{
+  if (!nextStep(thread_number, start, stop))
+    return false;
+
+  stop = min(stop, start + stepAt(start));
+  return true;
+}
+
+void CLMarkovPassGen::Generate(cl_ulong global_index, unsigned count,
+                               cl_uchar *passwords, unsigned entry_size)
+{
+  uint16_t digits[MAX_PASS_LENGTH];
+
+  unsigned length = lengthOf(global_index);
+
+  // Decode digits of the first password, the following ones are created
+  // by incrementing them
+  cl_ulong index = global_index - _permutations[length - 1];
+  cl_ulong radix = _permutations[length] - _permutations[length - 1];
+  for (unsigned p = 0; p < length; p++)
   {
-    _local_start_indexes[device_number] += _gws;
-    _kernels[device_number].setArg(6, _local_start_indexes[device_number]);
-    return true;
+    if (_prefix_major)
+    {
+      radix /= _thresholds[p];
+      digits[p] = index / radix;
+      index -= digits[p] * radix;
+    }
+    else
+    {
+      digits[p] = index % _thresholds[p];
+      index = index / _thresholds[p];
+    }
   }
 
-  if (reservePasswords(device_number))
+  for (unsigned k = 0; k < count; k++)
   {
-    _kernels[device_number].setArg(6, _local_start_indexes[device_number]);
-    _kernels[device_number].setArg(7, _local_stop_indexes[device_number]);
-    return true;
+    cl_uchar *password = passwords + k * entry_size;
+    cl_uchar last_char = 0;
+    unsigned max_rank = 0;
+
+    for (unsigned p = 0; p < length; p++)
+    {
+      last_char = _markov_table[rowOffset(p, last_char) + digits[p]];
+      password[p + PASS_PAYLOAD_OFFSET] = last_char;
+
+      if (p >= _sweep_from && digits[p] > max_rank)
+        max_rank = digits[p];
+    }
+
+    password[PASS_LENGTH_OFFSET] = length;
+    password[PASS_RANK_OFFSET] = max_rank;
+
+    // Increment digits, position 0 is the least significant one unless
+    // the order is prefix-major. Steps never cross a length, so the carry
+    // over all positions happens only after the last password
+    for (unsigned i = 0; i < length; i++)
+    {
+      unsigned p = _prefix_major ? length - 1 - i : i;
+      if (++digits[p] != _thresholds[p])
+        break;
+
+      digits[p] = 0;
+    }
+  }
+}
+
+unsigned CLMarkovPassGen::lengthOf(cl_ulong global_index)
+{
+  unsigned length = _min_length;
+  while (global_index >= _length_indexes[length])
+  {
+    length++;
   }
 
-  return false;
+  return length;
 }
 
-bool CLMarkovPassGen::reservePasswords(unsigned thread_number)
+cl_ulong CLMarkovPassGen::stepAt(cl_ulong global_index)
 {
-  _global_index_mutex.lock();
-  _local_start_indexes[thread_number] = _global_start_index;
-  _global_start_index += _resevation_size;
-  _global_index_mutex.unlock();
+  return _steps[lengthOf(min(global_index, _global_stop_index - 1))];
+}
 
-  _local_stop_indexes[thread_number] = _local_start_indexes[thread_number]
-                                         + _resevation_size;
+void CLMarkovPassGen::setKernelRange(unsigned device_number, cl_ulong start,
+                                     cl_ulong stop)
+{
+  // Range lies within single length, kernel gets local indexes
+  unsigned length = lengthOf(start);
+  cl_ulong first_index = _length_indexes[length - 1];
+  cl::Kernel & kernel = _kernels[device_number];
+
+  kernel.setArg(_first_arg + 4, length);
+  kernel.setArg(_first_arg + 5, start - first_index);
+  kernel.setArg(_first_arg + 6, stop - first_index);
+}
 
-  if (_local_start_indexes[thread_number] > _global_stop_index)
+void CLMarkovPassGen::initIndexes(unsigned num_devices)
+{
+  // Invalid values to prevent execution without reserved passwords
+  _local_start_indexes.assign(num_devices, 1);
+  _local_stop_indexes.assign(num_devices, 0);
+  _local_index_mutex.reset(new mutex[num_devices]);
+
+  _global_start_indexes.reset(new atomic<cl_ulong>[_num_groups]);
+  for (unsigned i = 0; i < _num_groups; i++)
+    _global_start_indexes[i] = _global_first_index;
+
+  _throughput.assign(num_devices, 0);
+  _num_processed.assign(num_devices, 0);
+  _reservation_time.assign(num_devices, chrono::steady_clock::now());
+}
+
+bool CLMarkovPassGen::nextStep(unsigned device_number, cl_ulong & start,
+                               cl_ulong & stop, bool whole_range)
+{
+  mutex & local_index_mutex = _local_index_mutex[device_number];
+
+  local_index_mutex.lock();
+  cl_ulong step = stepAt(_local_start_indexes[device_number]);
+  bool has_next = !whole_range && _local_start_indexes[device_number] + step
+      < _local_stop_indexes[device_number];
+
+  if (has_next)
+    _local_start_indexes[device_number] += step;
+  local_index_mutex.unlock();
+
+  if (!has_next && !reservePasswords(device_number)
+      && !stealPasswords(device_number))
     return false;
 
-  if (_local_stop_indexes[thread_number] > _global_stop_index)
-    _local_stop_indexes[thread_number] = _global_stop_index;
+  lock_guard<mutex> lock { local_index_mutex };
+  start = _local_start_indexes[device_number];
+  stop = _local_stop_indexes[device_number];
+
+  if (whole_range)
+  {
+    // Nothing is left to other devices to steal
+    _local_start_indexes[device_number] = stop;
+    _num_processed[device_number] += stop - start;
+  }
+  else
+  {
+    _num_processed[device_number] += min(stepAt(start), stop - start);
+  }
 
   return true;
+}
+
+double CLMarkovPassGen::reservationSize(unsigned device_number,
+                                        cl_ulong step)
+{
+  auto now = chrono::steady_clock::now();
+  double elapsed = chrono::duration<double>(
+      now - _reservation_time[device_number]).count();
+
+  // Update throughput by passwords processed since previous reservation
+  if (_num_processed[device_number] > 0 && elapsed > 0)
+  {
+    double throughput = _num_processed[device_number] / elapsed;
+    double & average = _throughput[device_number];
+
+    average = (average > 0) ? (average + throughput) / 2 : throughput;
+  }
+
+  _reservation_time[device_number] = now;
+  _num_processed[device_number] = 0;
 
+  double size = _initial_reservation_steps * step;
+  if (_throughput[device_number] > 0)
+    size = _throughput[device_number] * _reservation_duration;
+
+  // Shrink reservations as the keyspace runs out so that devices finish
+  // at the same time
+  cl_ulong next = _global_start_indexes[device_number % _num_groups].load();
+  cl_ulong remaining = (next < _global_stop_index) ?
+      _global_stop_index - next : 0;
+  unsigned group_size = max<size_t>(1, _local_start_indexes.size()
+      / _num_groups);
+  size = min(size, remaining / (2.0 * group_size));
+
+  return size;
+}
+
+bool CLMarkovPassGen::reservePasswords(unsigned device_number)
+{
+  atomic<cl_ulong> & global_start = _global_start_indexes[device_number
+      % _num_groups];
+  cl_ulong start = global_start.load();
+  cl_ulong stop;
+  double size = reservationSize(device_number, stepAt(start));
+
+  // Reservation ends at the last password of its length, so every kernel
+  // step generates passwords of single length
+  do
+  {
+    if (start >= _global_stop_index)
+      return false;
+
+    // Reserve whole kernel steps of the length only
+    unsigned length = lengthOf(start);
+    cl_ulong num_steps = ceil(size / _steps[length]);
+    num_steps = max<cl_ulong>(1, min<cl_ulong>(num_steps,
+                                               _max_reservation_steps));
+
+    stop = min(start + num_steps * _steps[length], _length_indexes[length]);
+  } while (!global_start.compare_exchange_weak(start, stop));
+
+  lock_guard<mutex> lock { _local_index_mutex[device_number] };
+  _local_start_indexes[device_number] = start;
+  _local_stop_indexes[device_number] = stop;
+
+  return true;
+}
+
+bool CLMarkovPassGen::stealPasswords(unsigned device_number)
+{
+  unsigned num_devices = _local_start_indexes.size();
+
+  while (true)
+  {
+    // Find device of the same group with the largest unfinished range
+    unsigned victim = num_devices;
+    cl_ulong largest_range = 0;
+
+    for (unsigned i = device_number % _num_groups; i < num_devices;
+         i += _num_groups)
+    {
+      if (i == device_number)
+        continue;
+
+      lock_guard<mutex> lock { _local_index_mutex[i] };
+      cl_ulong step = stepAt(_local_start_indexes[i]);
+      cl_ulong next = _local_start_indexes[i] + step;
+
+      // It's not worth to steal less than two steps
+      if (next < _local_stop_indexes[i]
+          && _local_stop_indexes[i] - next >= 2 * step
+          && _local_stop_indexes[i] - next > largest_range)
+      {
+        largest_range = _local_stop_indexes[i] - next;
+        victim = i;
+      }
+    }
+
+    if (victim == num_devices)
+      return false;
+
+    // Steal upper half of the range, victim's steps stay aligned
+    cl_ulong stolen_start, stolen_stop;
+    {
+      lock_guard<mutex> lock { _local_index_mutex[victim] };
+      cl_ulong step = stepAt(_local_start_indexes[victim]);
+      cl_ulong next = _local_start_indexes[victim] + step;
+
+      // Range was changed in the meantime, try again
+      if (next >= _local_stop_indexes[victim]
+          || _local_stop_indexes[victim] - next < 2 * step)
+        continue;
+
+      cl_ulong num_steps = (_local_stop_indexes[victim] - next) / step;
+      stolen_start = next + ((num_steps + 1) / 2) * step;
+      stolen_stop = _local_stop_indexes[victim];
+      _local_stop_indexes[victim] = stolen_start;
+    }
+
+    lock_guard<mutex> lock { _local_index_mutex[device_number] };
+    _local_start_indexes[device_number] = stolen_start;
+    _local_stop_indexes[device_number] = stolen_stop;
+
+    return true;
+  }
 }
 
 void CLMarkovPassGen::freeUnusedMemory()
 {
+  // Tables loaded from cache are owned by mapped file
+  if (_model_cache_file)
+  {
+    _model_cache_file.reset();
+    _thresholds = nullptr;
+    _permutations = nullptr;
+    _markov_table = nullptr;
+    return;
+  }
+
   delete[] _thresholds;
   _thresholds = nullptr;
   delete[] _permutations;
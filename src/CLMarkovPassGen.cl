@@ -22,51 +22,245 @@
  */
 
 #define CHARSET_SIZE 256
+#define MAX_PASS_LENGTH 50
 #define FLAG_RUN 0
 #define FLAG_END 1
 
-#define PASS_EXTRA_BYTES 1
-#define PASS_PAYLOAD_OFFSET 1
+#define PASS_EXTRA_BYTES 2
+#define PASS_PAYLOAD_OFFSET 2
 #define PASS_LENGTH_OFFSET 0
+#define PASS_RANK_OFFSET 1
 
-__kernel void markovGenerator (__global uchar *passwords, uint entry_size,
-                    __global uchar *markov_table, __constant uint *thresholds,
-                    __constant ulong *permutations, uint max_threshold,
-                    ulong index_start, ulong index_stop)
+#include "PassSlot.h"
+
+/*
+ * Run parameters can be baked in by host as SPEC_* defines, otherwise they
+ * are read from kernel arguments
+ */
+#ifdef SPEC_MAX_THRESHOLD
+#define MAX_THRESHOLD SPEC_MAX_THRESHOLD
+#else
+#define MAX_THRESHOLD max_threshold
+#endif
+
+/*
+ * Single layer of classic model is indexed without position, host places
+ * it in constant memory if it fits every device
+ */
+#ifdef SINGLE_LAYER
+#define LAYER(p) 0
+#else
+#define LAYER(p) (p)
+#endif
+
+#ifdef SINGLE_LAYER_CONSTANT
+#define MARKOV_TABLE __constant
+#else
+#define MARKOV_TABLE __global
+#endif
+
+#ifdef SPEC_MAX_LENGTH
+__constant uint spec_thresholds[] = { SPEC_THRESHOLDS };
+#define THRESHOLD(p) spec_thresholds[p]
+#define POSITIONS(length) SPEC_MAX_LENGTH
+#define UNROLL _Pragma("unroll")
+#else
+#define THRESHOLD(p) thresholds[p]
+#define POSITIONS(length) (length)
+#define UNROLL
+#endif
+
+/**
+ * Take digit (rank) of the next position from local index, positions are
+ * taken from 0. Position 0 is the least significant digit by default,
+ * with PREFIX_MAJOR the last position is, so neighbouring work-items share
+ * prefix of password and read the same rows of Markov table.
+ * @param index local index, the digit is removed from it
+ * @param radix number of passwords of the current length at first,
+ *        it's updated for the next position (only with PREFIX_MAJOR)
+ */
+ulong take_digit (ulong *index, ulong *radix, uint threshold)
+{
+  ulong digit;
+
+#ifdef PREFIX_MAJOR
+  *radix /= threshold;
+  digit = *index / *radix;
+  *index -= digit * *radix;
+#else
+  digit = *index % threshold;
+  *index /= threshold;
+#endif
+
+  return digit;
+}
+
+/**
+ * All passwords of single launch have the same length, index_start and
+ * index_stop are local indexes among passwords of this length. Passwords
+ * are written into slots of slot_size bytes.
+ */
+__kernel void markovGenerator (__global uchar *passwords, uint slot_size,
+                    MARKOV_TABLE uchar *markov_table,
+                    __constant uint *thresholds, __constant ulong *permutations,
+                    uint max_threshold, uint length, ulong index_start,
+                    ulong index_stop, uint sweep_from)
 {
   size_t id = get_global_id(0);
-  ulong global_index = index_start + id;
-  __global uchar *password = passwords + id * entry_size;
+  ulong index = index_start + id;
+  __global uchar *password = passwords + id * slot_size;
 
-  if (global_index > index_stop)
+  if (index >= index_stop)
   {
     password[PASS_LENGTH_OFFSET] = 0;
     return;
   }
 
+  ulong radix = permutations[length] - permutations[length - 1];
+  ulong partial_index;
+  uchar last_char = 0;
+  uint max_rank = 0;
+  uchar record[PASS_SLOT_SIZE(MAX_PASS_LENGTH)];
 
-  // Determine current length
-  uint length = 1;
-  while (global_index >= permutations[length])
+  // Create password
+  record[PASS_LENGTH_OFFSET] = length;
+  UNROLL
+  for (int p = 0; p < POSITIONS(length); p++)
   {
-    length++;
+    if (p >= length)
+      break;
+
+    partial_index = take_digit(&index, &radix, THRESHOLD(p));
+
+    last_char = markov_table[LAYER(p) * CHARSET_SIZE * MAX_THRESHOLD
+                             + last_char * MAX_THRESHOLD + partial_index];
+
+    record[p + PASS_PAYLOAD_OFFSET] = last_char;
+
+    // Highest rank on positions driven by global threshold
+    if (p >= sweep_from && partial_index > max_rank)
+      max_rank = partial_index;
   }
 
-  // Convert global index into local index
-  ulong index = global_index - permutations[length - 1];
-  ulong partial_index;
+  record[PASS_RANK_OFFSET] = max_rank;
+  store_slot(record, slot_size, password);
+}
+
+/**
+ * Decode local index of password of given length into digits (ranks on
+ * every position)
+ */
+void decode_digits (ulong index, uint length, __constant uint *thresholds,
+                    __constant ulong *permutations, ushort *digits)
+{
+  ulong radix = permutations[length] - permutations[length - 1];
+  UNROLL
+  for (int p = 0; p < POSITIONS(length); p++)
+  {
+    if (p >= length)
+      break;
+
+    digits[p] = take_digit(&index, &radix, THRESHOLD(p));
+  }
+}
+
+/**
+ * Increment digits to the following password of the same length, position 0
+ * is the least significant one (the last one with PREFIX_MAJOR). Ranges of
+ * launches never cross lengths, so the carry out of the last password of
+ * the length is never used.
+ */
+void next_digits (ushort *digits, uint length, __constant uint *thresholds)
+{
+#ifdef PREFIX_MAJOR
+  int p = length - 1;
+  while (p >= 0 && ++digits[p] == THRESHOLD(p))
+  {
+    digits[p] = 0;
+    p--;
+  }
+#else
+  uint p = 0;
+  while (p < length && ++digits[p] == THRESHOLD(p))
+  {
+    digits[p] = 0;
+    p++;
+  }
+#endif
+}
+
+/**
+ * Create password given by its digits in private memory
+ * @return highest rank on positions driven by global threshold
+ */
+uint create_password (uchar *password, const ushort *digits, uint length,
+                      MARKOV_TABLE uchar *markov_table, uint max_threshold,
+                      uint sweep_from)
+{
   uchar last_char = 0;
+  uint max_rank = 0;
 
-  // Create password
-  password[PASS_LENGTH_OFFSET] = length;
-  for (int p = 0; p < length; p++)
+  UNROLL
+  for (int p = 0; p < POSITIONS(length); p++)
+  {
+    if (p >= length)
+      break;
+
+    last_char = markov_table[LAYER(p) * CHARSET_SIZE * MAX_THRESHOLD
+                             + last_char * MAX_THRESHOLD + digits[p]];
+
+    password[p] = last_char;
+
+    if (p >= sweep_from && digits[p] > max_rank)
+      max_rank = digits[p];
+  }
+
+  return max_rank;
+}
+
+/**
+ * Generate per_item consecutive passwords, only the first one is decoded
+ * from global index, following ones are created by incrementing digits
+ */
+__kernel void markovGeneratorMulti (__global uchar *passwords, uint slot_size,
+                    MARKOV_TABLE uchar *markov_table,
+                    __constant uint *thresholds, __constant ulong *permutations,
+                    uint max_threshold, uint length, ulong index_start,
+                    ulong index_stop, uint sweep_from, uint per_item)
+{
+  size_t id = get_global_id(0);
+  ulong index = index_start + id * per_item;
+  __global uchar *password = passwords + id * per_item * slot_size;
+  ushort digits[MAX_PASS_LENGTH];
+  uchar record[PASS_SLOT_SIZE(MAX_PASS_LENGTH)];
+
+  if (index >= index_stop)
+  {
+    for (uint k = 0; k < per_item; k++)
+      password[k * slot_size + PASS_LENGTH_OFFSET] = 0;
+    return;
+  }
+
+  decode_digits(index, length, thresholds, permutations, digits);
+
+  for (uint k = 0; k < per_item; k++)
   {
-    partial_index = index % thresholds[p];
-    index = index / thresholds[p];
+    if (index >= index_stop)
+    {
+      password[PASS_LENGTH_OFFSET] = 0;
+    }
+    else
+    {
+      record[PASS_RANK_OFFSET] = create_password(
+          record + PASS_PAYLOAD_OFFSET, digits, length, markov_table,
+          max_threshold, sweep_from);
+      record[PASS_LENGTH_OFFSET] = length;
+      store_slot(record, slot_size, password);
+    }
 
-    last_char = markov_table[p * CHARSET_SIZE * max_threshold
-                             + last_char * max_threshold + partial_index];
+    password += slot_size;
+    index++;
 
-    password[p + PASS_PAYLOAD_OFFSET] = last_char;
+    next_digits(digits, length, thresholds);
   }
 }
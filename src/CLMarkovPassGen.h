@@ -36,9 +36,13 @@
 #include <string>
 #include <fstream>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
 
 #include "Constants.h"
 #include "Mask.h"
+#include "MappedFile.h"
 
 const unsigned ETX = 3;
 
@@ -55,6 +59,14 @@ public:
     std::string thresholds = "5";
     std::string length = "1:64";
     std::string mask;
+    std::string sweep;
+    unsigned per_item = 1;
+    std::string model_cache;
+    /**
+     * Enumerate passwords with the last position varying fastest, so
+     * neighbouring work-items share prefix (same set of passwords)
+     */
+    bool prefix_major = false;
   };
 
   CLMarkovPassGen(Options & options);
@@ -70,21 +82,50 @@ public:
    * @return
    */
   std::string GetKernelName();
+  /**
+   * Get options for compilation of the kernel, it must be called before
+   * InitKernel
+   * @param devices devices the kernel is built for, single layer of Markov
+   *        table is placed in constant memory only if it fits all of them
+   * @param specialize bake run parameters into the kernel as constants
+   */
+  std::string GetBuildOptions(const std::vector<cl::Device> & devices,
+                              bool specialize = true);
 
   /**
-   * Set Global Work Size
+   * Set Global Work Size, steps of all lengths have the same size
    */
   void SetGWS(std::size_t gws);
 
+  /**
+   * Size steps of every length to fill buffer of given size with slots of
+   * PASS_SLOT_SIZE(length) bytes, shorter passwords are generated by larger
+   * steps. Buffer must fit at least one work-item of the longest passwords.
+   */
+  void SetBufferSize(std::size_t size);
+
+  /**
+   * Return number of passwords generated by single work-item
+   */
+  unsigned CandidatesPerItem();
+
+  /**
+   * Split devices into groups which generate the whole keyspace each,
+   * device i belongs to group i % num_groups, it must be called before
+   * InitKernel (every device holds only a shard of dictionary)
+   */
+  void SetDeviceGroups(unsigned num_groups);
+
   /**
    * Create buffers and set arguments
    * @param kernel
    * @param command_queue
    * @param context
+   * @param first_arg index of the first argument belonging to generator
    */
   void InitKernel(std::vector<cl::Kernel> & kernels,
                   std::vector<cl::CommandQueue> & queues,
-                  cl::Context & context);
+                  cl::Context & context, unsigned first_arg = 2);
 
   /**
    * Set up parameters for next kernel step
@@ -92,11 +133,88 @@ public:
    */
   bool NextKernelStep(unsigned device_number);
 
+  /**
+   * Return global index of the first password of the last kernel step
+   * of device
+   */
+  cl_ulong StepStart(unsigned device_number);
+
+  /**
+   * Return length of passwords of the last kernel step of device, all
+   * passwords of a step have the same length
+   */
+  unsigned StepLength(unsigned device_number);
+
+  /**
+   * Return number of passwords of the last kernel step of device including
+   * the ones past its range, kernel is executed for all of them
+   */
+  cl_ulong StepSize(unsigned device_number);
+
+  /**
+   * Set up parameters for kernel processing the whole next reservation
+   * at once (persistent kernels)
+   * @return FALSE if there is nothing to generate
+   */
+  bool NextKernelRange(unsigned device_number);
+
+  /**
+   * Prepare generator for given number of host threads (instead of kernels)
+   */
+  void InitHost(unsigned num_threads);
+
+  /**
+   * Get next range of at most GWS passwords for host thread
+   * @param start first global index (output)
+   * @param stop global index after the last one (output)
+   * @return FALSE if there is nothing to generate
+   */
+  bool NextHostStep(unsigned thread_number, cl_ulong & start,
+                    cl_ulong & stop);
+
+  /**
+   * Generate consecutive passwords on host, layout of the passwords is same
+   * as in generator's kernel
+   * @param global_index index of the first password
+   * @param count number of passwords, all of them have the same length as
+   *        steps never cross a length
+   * @param passwords output buffer with count * entry_size bytes
+   */
+  void Generate(cl_ulong global_index, unsigned count, cl_uchar *passwords,
+                unsigned entry_size);
+
+  /**
+   * Return global index of the first generated password
+   */
+  cl_ulong FirstIndex();
+
+  /**
+   * Return minimum length of password
+   */
+  unsigned MinPasswordLength();
+
   /**
    * Return maximum length of password
    */
   unsigned MaxPasswordLength();
 
+  /**
+   * Compute position of the password in the generated keyspace, i.e. inverse
+   * of the generator kernel
+   * @param password password without terminating zero
+   * @param length length of password
+   * @param guess_number global index of the password (output)
+   * @param rank highest rank on positions driven by global threshold (output)
+   * @return FALSE if the password is never generated
+   */
+  bool GuessNumber(const cl_uchar *password, unsigned length,
+                   cl_ulong & guess_number, unsigned & rank);
+
+  /**
+   * Return global thresholds evaluated in a single sweep (empty if disabled)
+   */
+  const std::vector<unsigned> & SweepThresholds();
+
   /**
    * Print detailed informations
    */
@@ -120,16 +238,51 @@ private:
     CLASSIC = 1, LAYERED = 2
   };
 
+  /**
+   * Header of cached model, it's followed by permutations, thresholds
+   * and Markov table
+   */
+  struct ModelCacheHeader
+  {
+    char magic[8];
+    uint64_t key;
+    uint32_t max_length;
+    uint32_t max_threshold;
+    uint32_t markov_table_size;
+    uint32_t reserved;
+  };
+
   const std::string _kernel_name = "markovGenerator";
+  const std::string _kernel_name_multi = "markovGeneratorMulti";
   const std::string _kernel_source = "kernels/CLMarkovPassGen.cl";
+  const char _model_cache_magic[8] = "WMODEL2";
+  /**
+   * Longer passwords use generic per-position loops in the kernel
+   */
+  const unsigned _max_specialized_length = 16;
 
   std::string _stat_file;
+  std::string _mask_string;
   Mask _mask;
+  /**
+   * Directory with cached models (empty if disabled)
+   */
+  std::string _model_cache;
+  bool _prefix_major;
+  /**
+   * Cached model which the tables point to, if they were loaded from cache
+   */
+  std::unique_ptr<MappedFile> _model_cache_file;
 
   Model _model;
+  /**
+   * Classic model with the same mask on all positions has the same rows
+   * everywhere, its table is a single layer indexed without position
+   */
+  bool _single_layer;
 
   /**
-   * 3D Markov table
+   * 3D Markov table, or 2D with single layer
    */
   cl_uchar *_markov_table;
   /**
@@ -156,16 +309,57 @@ private:
    * Maximum threshold
    */
   cl_uint _max_threshold;
+  /**
+   * First position which isn't set by positional threshold
+   */
+  cl_uint _sweep_from = 0;
+  /**
+   * Ascending global thresholds for sweep mode
+   */
+  std::vector<unsigned> _sweep_thresholds;
 
-  // TODO
-  cl_ulong _global_start_index;
+  /**
+   * First global index which isn't reserved by any device of the group yet,
+   * groups of devices don't share the keyspace
+   */
+  std::unique_ptr<std::atomic<cl_ulong>[]> _global_start_indexes;
+  cl_ulong _global_first_index;
   cl_ulong _global_stop_index;
+  /**
+   * Copy of permutations kept after the tables are uploaded to devices,
+   * ranges of kernels are split by it into lengths
+   */
+  std::vector<cl_ulong> _length_indexes;
+  unsigned _num_groups = 1;
+  /**
+   * Range owned by every device, start is the index of the last issued step.
+   * Ranges are guarded by per-device mutex, because idle devices can steal
+   * their unfinished part.
+   */
   std::vector<cl_ulong> _local_start_indexes;
   std::vector<cl_ulong> _local_stop_indexes;
-  std::size_t _gws;
-  uint64_t _resevation_size;
+  std::unique_ptr<std::mutex[]> _local_index_mutex;
+  /**
+   * Measured throughput of every device in passwords per second
+   */
+  std::vector<double> _throughput;
+  std::vector<cl_ulong> _num_processed;
+  std::vector<std::chrono::steady_clock::time_point> _reservation_time;
+  /**
+   * Reservation should keep device busy for this number of seconds
+   */
+  const double _reservation_duration = 1.0;
+  const unsigned _initial_reservation_steps = 16;
+  const unsigned _max_reservation_steps = 10000;
 
-  std::mutex _global_index_mutex;
+  std::size_t _gws;
+  /**
+   * Number of passwords generated by single kernel execution for every
+   * length, it's a multiple of passwords per work-item
+   */
+  std::vector<cl_ulong> _steps;
+  cl_uint _per_item;
+  unsigned _first_arg;
 
   std::vector<cl::Kernel> _kernels;
 
@@ -174,14 +368,52 @@ private:
   std::vector<cl::Buffer> _permutations_buffer;
 
   void initMemory();
+  std::string modelCachePath(uint64_t key);
+  bool loadModelCache(const std::string & path, uint64_t key);
+  void storeModelCache(const std::string & path, uint64_t key);
+  uint64_t modelKey();
   void parseOptions(Options & options);
 
-  static int compareSortElements(const void *p1, const void *p2);
+  static bool compareSortElements(const SortElement & e1,
+                                  const SortElement & e2);
   static bool isValidChar(uint8_t value);
   uint64_t numPermutations(unsigned length);
-  unsigned findStatistics(std::ifstream & stat_file);
-  void applyMask(SortElement *table[MAX_PASS_LENGTH][CHARSET_SIZE]);
-  bool reservePasswords(unsigned thread_number);
+  const uint8_t * findStatistics(const MappedFile & stat_file,
+                                 uint32_t & length);
+  void buildRow(const uint8_t *statistics, unsigned position,
+                unsigned last_char);
+  /**
+   * Return offset of row of Markov table for given position and previous
+   * character
+   */
+  unsigned rowOffset(unsigned position, unsigned last_char);
+  /**
+   * Return length of password with given global index
+   */
+  unsigned lengthOf(cl_ulong global_index);
+  /**
+   * Return size of step generating password with given global index,
+   * indexes past the keyspace belong to the longest length
+   */
+  cl_ulong stepAt(cl_ulong global_index);
+  /**
+   * Set range of kernel as its length and local indexes
+   */
+  void setKernelRange(unsigned device_number, cl_ulong start, cl_ulong stop);
+  void initIndexes(unsigned num_devices);
+  /**
+   * Get next step of device, neither steps nor reservations cross boundary
+   * of lengths
+   */
+  bool nextStep(unsigned device_number, cl_ulong & start, cl_ulong & stop,
+                bool whole_range = false);
+  /**
+   * Return number of passwords to reserve, it isn't rounded to steps yet
+   * @param step size of step of the next reserved passwords
+   */
+  double reservationSize(unsigned device_number, cl_ulong step);
+  bool reservePasswords(unsigned device_number);
+  bool stealPasswords(unsigned device_number);
   void freeUnusedMemory();
 };
 
@@ -27,6 +27,13 @@
 const unsigned MIN_PASS_LENGTH = 1;
 const unsigned MAX_PASS_LENGTH = 50;
 const unsigned CHARSET_SIZE = 256;
+const unsigned MAX_SWEEP_THRESHOLD = 255;
+
+// Layout of generated password
+#define PASS_EXTRA_BYTES 2
+#define PASS_PAYLOAD_OFFSET 2
+#define PASS_LENGTH_OFFSET 0
+#define PASS_RANK_OFFSET 1
 
 
 #endif /* CONSTANTS_H_ */
@@ -28,10 +28,34 @@
 #include <iostream>
 
 #include <fstream>
+#include <sstream>
 #include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
 
 using namespace std;
 
+/**
+ * Insert every line between begin and end into hash table
+ */
+void insertLines(HashTable *hash_table, const char *begin, const char *end)
+{
+  while (begin < end)
+  {
+    const char *line_end = static_cast<const char *>(memchr(begin, '\n',
+                                                            end - begin));
+    if (line_end == nullptr)
+      line_end = end;
+
+    hash_table->Insert(reinterpret_cast<const cl_uchar *>(begin),
+                       line_end - begin);
+    begin = line_end + 1;
+  }
+}
+
 std::string makeString(cl_uchar *ht_element)
 {
   char buffer[256];
@@ -46,39 +70,188 @@ std::string makeString(cl_uchar *ht_element)
 }
 
 Cracker::Cracker(Options options) :
-    _print_passwords { options.print_passwords }
+    _print_passwords { options.print_passwords },
+    _guess_curve { options.guess_curve },
+    _first_index { options.first_index },
+    _min_length { options.min_length }, _max_length { options.max_length },
+    _last_report { chrono::steady_clock::now() }
+{
+  auto start_time = chrono::steady_clock::now();
+
+  if (options.shards == 0)
+    throw invalid_argument("Invalid value for argument 'shards'");
+
+  if (loadIndex(options.dictionary))
+  {
+    // Layout of the table is fixed when the index is written
+    Options defaults;
+    if (options.max_load_factor != defaults.max_load_factor
+        || options.bloom_bits != defaults.bloom_bits
+        || options.perfect_hash != defaults.perfect_hash)
+      throw invalid_argument("Arguments 'load-factor', 'bloom-bits' and "
+                             "'perfect-hash' are given by index, rebuild it "
+                             "to change them");
+
+    cout << "Dictionary index: " << _hash_table_size << " bytes\n";
+  }
+  else
+    buildHashTable(options);
+
+  if (_flat_hash_tables.size() > 1)
+    cout << "Dictionary shards: " << _flat_hash_tables.size() << "\n";
+
+  printBloom();
+
+  chrono::duration<double> startup_time = chrono::steady_clock::now()
+      - start_time;
+  cout << "Dictionary ready in " << startup_time.count() << " s" << endl;
+}
+
+Cracker::~Cracker()
+{
+  if (!_index_file)
+  {
+    for (auto flat_hash_table : _flat_hash_tables)
+      HashTable::Free(flat_hash_table);
+  }
+}
+
+void Cracker::StoreIndex(const std::string & path)
+{
+  IndexHeader header = { };
+  memcpy(header.magic, _index_magic, sizeof(header.magic));
+  header.hash_table_size = _hash_table_size;
+
+  // Header is padded to page, so mapped tables are aligned as well
+  vector<char> header_page(HT_PAGE_SIZE, 0);
+  memcpy(header_page.data(), &header, sizeof(header));
+
+  ofstream index { path, ofstream::out | ofstream::binary };
+  index.write(header_page.data(), header_page.size());
+
+  // Tables of shards follow each other, every one knows its size
+  for (auto flat_hash_table : _flat_hash_tables)
+    index.write(reinterpret_cast<const char *>(flat_hash_table),
+                HashTable::Size(flat_hash_table));
+
+  if (!index.good())
+    throw runtime_error { "Unable to write index: " + path };
+}
+
+bool Cracker::loadIndex(const std::string & path)
 {
-  ifstream dictionary { options.dictionary, ifstream::in };
+  IndexHeader header;
+
+  // Plain dictionaries are recognized by missing magic, the last character
+  // of magic is version of the index
+  ifstream input { path, ifstream::in | ifstream::binary };
+  if (!input.read(reinterpret_cast<char *>(&header), sizeof(header))
+      || memcmp(header.magic, _index_magic, _index_version_offset) != 0)
+    return false;
+
+  if (memcmp(header.magic, _index_magic, sizeof(header.magic)) != 0)
+    throw runtime_error { "Index was written by other version: " + path };
+
+  input.close();
+
+  // Private mapping, flags of cracked passwords and shrunk Bloom filter
+  // don't change the file
+  _index_file.reset(new MappedFile { path, true });
+  if (_index_file->Size() != HT_PAGE_SIZE + header.hash_table_size)
+    throw runtime_error { "Index is damaged: " + path };
+
+  _hash_table_size = header.hash_table_size;
+
+  cl_uchar *data = _index_file->MutableData() + HT_PAGE_SIZE;
+  size_t directory_size = HT_DIR_RECORDS * HT_DIR_FIELDS * sizeof(cl_uint);
+
+  for (size_t offset = 0; offset < _hash_table_size; )
+  {
+    size_t size = (_hash_table_size - offset < directory_size) ? 0
+        : HashTable::Size(&data[offset]);
 
-  unsigned num_lines = count(istreambuf_iterator<char>(dictionary),
-                             istreambuf_iterator<char>(), '\n') + 1;
+    if (size < directory_size || size > _hash_table_size - offset
+        || size % HT_PAGE_SIZE != 0)
+      throw runtime_error { "Index is damaged: " + path };
 
-  dictionary.close();
-  dictionary.open(options.dictionary, ifstream::in);
+    _flat_hash_tables.push_back(&data[offset]);
+    offset += size;
+  }
+
+  if (_flat_hash_tables.empty()
+      || _flat_hash_tables.size() != HashTable::NumShards(data))
+    throw runtime_error { "Index is damaged: " + path };
+
+  return true;
+}
+
+void Cracker::buildHashTable(Options & options)
+{
+  DictionaryReader dictionary { options.dictionary };
 
   HashTable *hash_table;
-  hash_table = new HashTable { num_lines, options.max_load_factor };
+  hash_table = new HashTable { options.max_load_factor, options.min_length,
+                               options.max_length, options.bloom_bits,
+                               options.perfect_hash };
+
+  unsigned num_threads = max(1u, thread::hardware_concurrency());
+  vector<char> block, next_block;
+  auto start_time = chrono::steady_clock::now();
 
-  string word;
-  while (dictionary.good())
+  bool has_block = dictionary.Read(block);
+  while (has_block)
   {
-    getline(dictionary, word);
-    hash_table->Insert(word);
+    // Threads parse chunks of the block while the next block is read
+    vector<thread> threads;
+    const char *chunk_start = block.data();
+    const char *block_end = block.data() + block.size();
+
+    for (unsigned i = 0; i < num_threads && chunk_start < block_end; i++)
+    {
+      const char *chunk_end = max<const char *>(chunk_start, block.data()
+          + block.size() * (i + 1) / num_threads);
+
+      // Chunk ends with the whole line
+      const char *line_end = static_cast<const char *>(memchr(
+          chunk_end, '\n', block_end - chunk_end));
+      chunk_end = (line_end != nullptr) ? line_end + 1 : block_end;
+
+      threads.emplace_back(insertLines, hash_table, chunk_start, chunk_end);
+      chunk_start = chunk_end;
+    }
+
+    has_block = dictionary.Read(next_block);
+
+    for (auto & thread : threads)
+      thread.join();
+
+    block.swap(next_block);
   }
 
-  _hash_table_size = hash_table->Serialize(&_flat_hash_table, _num_rows,
-                                           _num_entries, _entry_size,
-                                           _row_size);
+  chrono::duration<double> ingest_time = chrono::steady_clock::now()
+      - start_time;
+  double megabytes = dictionary.BytesRead() / 1e6;
+
+  cout << "Dictionary ingested: " << megabytes << " MB in "
+       << ingest_time.count() << " s (" << megabytes / ingest_time.count()
+       << " MB/s)" << endl;
+
+  for (unsigned shard = 0; shard < options.shards; shard++)
+  {
+    cl_uchar *flat_hash_table;
+    _hash_table_size += hash_table->Serialize(&flat_hash_table, shard,
+                                              options.shards);
+    _flat_hash_tables.push_back(flat_hash_table);
+  }
 
   hash_table->Details();
 
   delete hash_table;
-
 }
 
-Cracker::~Cracker()
+unsigned Cracker::NumShards()
 {
-  delete[] _flat_hash_table;
+  return _flat_hash_tables.size();
 }
 
 std::string Cracker::GetKernelSource()
@@ -93,25 +266,207 @@ std::string Cracker::GetKernelName()
 
 void Cracker::InitKernel(std::vector<cl::Kernel> & kernels,
                          std::vector<cl::CommandQueue> & queues,
-                         cl::Context& context)
+                         cl::Context& context, unsigned first_arg,
+                         unsigned num_slots)
 {
+  unsigned num_shards = _flat_hash_tables.size();
+
+  _kernels = kernels;
+  _first_arg = first_arg;
+
+  if (kernels.size() < num_shards)
+    throw invalid_argument { "Every shard of dictionary needs its own device" };
+
+  // Filters of all shards have to fit the smallest local memory
+  size_t max_bloom_size = SIZE_MAX;
+  for (auto & queue : queues)
+  {
+    cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+    size_t local_memory = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+
+    max_bloom_size = min(max_bloom_size,
+                         local_memory - min(local_memory, _local_memory_reserve));
+  }
+
+  bool shrunk = false;
+  for (auto flat_hash_table : _flat_hash_tables)
+    shrunk |= HashTable::ShrinkBloom(flat_hash_table, max_bloom_size);
+
+  if (shrunk)
+  {
+    cout << "Bloom filter was shrunk to fit local memory" << endl;
+    printBloom();
+  }
+
+  // CPU devices access the table in host memory without any copy
+  bool cpu_devices = true;
+  for (auto & queue : queues)
+  {
+    cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+    cpu_devices &= (device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU);
+  }
+
+  for (unsigned shard = 0; shard < num_shards; shard++)
+  {
+    cl_uchar *flat_hash_table = _flat_hash_tables[shard];
+    size_t size = HashTable::Size(flat_hash_table);
+
+    // Table is a single buffer on every device of the shard
+    for (unsigned i = shard; i < queues.size(); i += num_shards)
+    {
+      cl::Device device = queues[i].getInfo<CL_QUEUE_DEVICE>();
+      if (size > device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>())
+        throw runtime_error { "Dictionary doesn't fit device memory, "
+                              "use more shards" };
+    }
+
+    // Zero copy needs the table aligned to page, which holds unless the
+    // index couldn't be mapped
+    if (cpu_devices
+        && reinterpret_cast<uintptr_t>(flat_hash_table) % HT_PAGE_SIZE == 0)
+    {
+      _hash_table_buffer.push_back(cl::Buffer { context,
+                                                CL_MEM_READ_ONLY
+                                                | CL_MEM_USE_HOST_PTR,
+                                                size, flat_hash_table });
+    }
+    else
+    {
+      // Other queues use the buffer as soon as they start, so it's blocking
+      _hash_table_buffer.push_back(cl::Buffer { context, CL_MEM_READ_ONLY,
+                                                size });
+      queues[shard].enqueueWriteBuffer(_hash_table_buffer.back(), CL_TRUE, 0,
+                                       size, flat_hash_table);
+    }
+
+    _num_entries.push_back(HashTable::NumEntries(flat_hash_table));
+  }
+
   for (int i = 0; i < kernels.size(); i++)
   {
     cl::Kernel & kernel = kernels[i];
     cl::CommandQueue & queue = queues[i];
+    unsigned shard = i % num_shards;
 
     _cmd_queue.push_back(queue);
 
-    cl::Buffer hash_table_buffer { context, CL_MEM_READ_WRITE, _hash_table_size };
-    queue.enqueueWriteBuffer(hash_table_buffer, CL_FALSE, 0, _hash_table_size,
-                             _flat_hash_table);
-    _hash_table_buffer.push_back(hash_table_buffer);
+    size_t flags_size = max(_num_entries[shard], (size_t) 1);
+    cl::Buffer found_flags_buffer { context, CL_MEM_READ_WRITE, flags_size };
+    queue.enqueueFillBuffer(found_flags_buffer, (cl_uchar) HT_NOTFOUND, 0,
+                            flags_size);
+    _found_flags_buffer.push_back(found_flags_buffer);
+
+    // Kernels need local buffer even if the filter is disabled
+    size_t bloom_size = max(HashTable::BloomSize(_flat_hash_tables[shard]),
+                            sizeof(cl_ulong));
+
+    // Every password is cracked at most once, so logs of small dictionaries
+    // never overflow
+    cl_uint hit_capacity = max<size_t>(1, min<size_t>(_num_entries[shard],
+                                                      _max_hit_capacity));
+    _hit_capacity.push_back(hit_capacity);
+    _hit_logs.emplace_back(num_slots);
+
+    // Cursors are reset before every batch
+    for (HitLog & log : _hit_logs[i])
+    {
+      log.hits = cl::Buffer { context, CL_MEM_WRITE_ONLY,
+                              hit_capacity * HIT_FIELDS * sizeof(cl_ulong) };
+      log.cursor = cl::Buffer { context, CL_MEM_READ_WRITE, sizeof(cl_uint) };
+      log.records.resize(min(hit_capacity, _max_hit_prefetch) * HIT_FIELDS);
+    }
 
-    kernel.setArg(2, hash_table_buffer);
-    kernel.setArg(3, _num_rows);
-    kernel.setArg(4, _num_entries);
-    kernel.setArg(5, _entry_size);
-    kernel.setArg(6, _row_size);
+    kernel.setArg(first_arg, _hash_table_buffer[shard]);
+    kernel.setArg(first_arg + 1, found_flags_buffer);
+    kernel.setArg(first_arg + 2, cl::Local(bloom_size));
+    kernel.setArg(first_arg + 3, _hit_logs[i][0].hits);
+    kernel.setArg(first_arg + 4, _hit_logs[i][0].cursor);
+    kernel.setArg(first_arg + 5, hit_capacity);
+  }
+}
+
+void Cracker::SetHitLog(unsigned device_number, unsigned slot,
+                        std::vector<cl::Event> & events)
+{
+  HitLog & log = _hit_logs[device_number][slot];
+  cl::Event event;
+
+  _cmd_queue[device_number].enqueueFillBuffer(log.cursor, (cl_uint) 0, 0,
+                                              sizeof(cl_uint), nullptr, &event);
+  events.push_back(event);
+
+  _kernels[device_number].setArg(_first_arg + 3, log.hits);
+  _kernels[device_number].setArg(_first_arg + 4, log.cursor);
+}
+
+void Cracker::ReadHitLog(unsigned device_number, unsigned slot,
+                         const std::vector<cl::Event> & batch_events)
+{
+  cl::CommandQueue & queue = _cmd_queue[device_number];
+  HitLog & log = _hit_logs[device_number][slot];
+  cl::Event event;
+
+  log.read_events.clear();
+
+  queue.enqueueReadBuffer(log.cursor, CL_FALSE, 0, sizeof(cl_uint),
+                          &log.num_hits, &batch_events, &event);
+  log.read_events.push_back(event);
+
+  queue.enqueueReadBuffer(log.hits, CL_FALSE, 0,
+                          log.records.size() * sizeof(cl_ulong),
+                          log.records.data(), &batch_events, &event);
+  log.read_events.push_back(event);
+}
+
+void Cracker::DrainHitLog(unsigned device_number, unsigned slot)
+{
+  HitLog & log = _hit_logs[device_number][slot];
+
+  cl::WaitForEvents(log.read_events);
+  if (log.num_hits == 0)
+    return;
+
+  cl_uint num_logged = min(log.num_hits, _hit_capacity[device_number]);
+  vector<cl_ulong> records { log.records };
+
+  // Rest of large log is read now, on in-order queue it waits for batches
+  // enqueued in the meantime
+  if (num_logged * HIT_FIELDS > records.size())
+  {
+    size_t prefetched = records.size();
+
+    records.resize(num_logged * HIT_FIELDS);
+    _cmd_queue[device_number].enqueueReadBuffer(log.hits, CL_TRUE,
+        prefetched * sizeof(cl_ulong),
+        (records.size() - prefetched) * sizeof(cl_ulong),
+        records.data() + prefetched);
+  }
+
+  vector<Hit> hits;
+  unsigned shard = device_number % _flat_hash_tables.size();
+
+  for (unsigned i = 0; i < num_logged; i++)
+  {
+    hits.push_back(Hit { shard, (cl_uint) records[i * HIT_FIELDS + HIT_ENTRY],
+                         records[i * HIT_FIELDS + HIT_INDEX] });
+  }
+
+  addHits(hits, log.num_hits - num_logged);
+}
+
+void Cracker::addHits(const std::vector<Hit> & hits, std::size_t num_lost)
+{
+  lock_guard<mutex> lock { _hits_mutex };
+
+  _hits.insert(_hits.end(), hits.begin(), hits.end());
+  _num_lost_hits += num_lost;
+
+  auto now = chrono::steady_clock::now();
+  if (chrono::duration<double>(now - _last_report).count() >= _report_interval)
+  {
+    cout << "Passwords cracked so far: " << _hits.size() + _num_lost_hits
+         << endl;
+    _last_report = now;
   }
 }
 
@@ -119,35 +474,248 @@ void Cracker::Details()
 {
 }
 
-void Cracker::PrintResults()
+void Cracker::Evaluate(const std::function<bool(const cl_uchar *, unsigned,
+                                                unsigned &, cl_ulong &)> & is_generated)
 {
-  unsigned total_num_elements = _num_entries * _num_rows;
-  unsigned index;
-  unsigned num_cracked_passwords = 0;
-  vector<string> cracked_passwords;
+  unsigned rank;
+  cl_ulong global_index;
+  vector<Hit> hits;
 
-  // Update flags in hash table
-  for (unsigned i = 0; i < _cmd_queue.size(); i++)
+  for (unsigned shard = 0; shard < _flat_hash_tables.size(); shard++)
   {
-    _cmd_queue[i].enqueueReadBuffer(_hash_table_buffer[i], CL_TRUE, 0,
-                                    _hash_table_size, _flat_hash_table);
+    cl_uchar *flat_hash_table = _flat_hash_tables[shard];
 
-    // Count cracked passwords
-    for (unsigned i = 0; i < total_num_elements; i++)
+    forEachEntry(flat_hash_table, [&] (cl_uchar *entry)
     {
-      index = _entry_size * i;
-
-      if (_flat_hash_table[index + HT_FLAG_OFFSET] == HT_FOUND)
-      {
-        num_cracked_passwords++;
-        if (_print_passwords)
-          cracked_passwords.push_back(makeString(&_flat_hash_table[index]));
-      }
+      if (!is_generated(&entry[HT_PAYLOAD_OFFSET], entry[HT_LENGTH_OFFSET],
+                        rank, global_index))
+        return;
+
+      entry[HT_FLAG_OFFSET] = HT_FOUND + min(rank, (unsigned) HT_MAX_RANK);
+      hits.push_back(Hit { shard, entryIndex(flat_hash_table, entry),
+                           global_index });
+    });
+  }
+
+  addHits(hits, 0);
+}
+
+void Cracker::Crack(const cl_uchar *passwords, unsigned entry_size,
+                    unsigned count, cl_ulong global_index)
+{
+  unsigned num_shards = _flat_hash_tables.size();
+  vector<Hit> hits;
+  vector<uint32_t> hashes(count);
+
+  // Whole batch is hashed first, the loop has no branches on table and
+  // independent passwords can be hashed in parallel
+  for (unsigned i = 0; i < count; i++)
+  {
+    const cl_uchar *password = passwords + i * entry_size;
+    hashes[i] = HashTable::Hash(&password[PASS_PAYLOAD_OFFSET],
+                                password[PASS_LENGTH_OFFSET]);
+  }
+
+  for (unsigned i = 0; i < count; i++)
+  {
+    const cl_uchar *password = passwords + i * entry_size;
+    unsigned password_length = password[PASS_LENGTH_OFFSET];
+
+    if (password_length == 0)
+      continue;
+
+    // Password is looked up only in table of its shard
+    unsigned shard = (num_shards == 1) ? 0 : HashTable::ShardOf(hashes[i],
+                                                                num_shards);
+
+    cl_uchar *entry = HashTable::Find(_flat_hash_tables[shard],
+                                      &password[PASS_PAYLOAD_OFFSET],
+                                      password_length, hashes[i]);
+    if (entry == nullptr)
+      continue;
+
+    entry[HT_FLAG_OFFSET] = HT_FOUND
+        + min((unsigned) password[PASS_RANK_OFFSET], (unsigned) HT_MAX_RANK);
+    hits.push_back(Hit { shard, entryIndex(_flat_hash_tables[shard], entry),
+                         global_index + i });
+  }
+
+  if (!hits.empty())
+    addHits(hits, 0);
+}
+
+cl_uint Cracker::entryIndex(const cl_uchar *flat_hash_table,
+                            const cl_uchar *entry)
+{
+  unsigned length = entry[HT_LENGTH_OFFSET];
+  const cl_uint *sub_table = reinterpret_cast<const cl_uint *>(flat_hash_table)
+      + length * HT_DIR_FIELDS;
+
+  return sub_table[HT_DIR_FLAGS] + (entry
+      - &flat_hash_table[sub_table[HT_DIR_ENTRIES]]) / (length + HT_EXTRA_BYTES);
+}
+
+void Cracker::forEachEntry(cl_uchar *flat_hash_table,
+                           const std::function<void(cl_uchar *)> & fn)
+{
+  const cl_uint *directory = reinterpret_cast<const cl_uint *>(flat_hash_table);
+
+  for (unsigned length = 0; length <= MAX_PASS_LENGTH; length++)
+  {
+    const cl_uint *sub_table = &directory[length * HT_DIR_FIELDS];
+    cl_uchar *entries = &flat_hash_table[sub_table[HT_DIR_ENTRIES]];
+
+    for (unsigned i = 0; i < sub_table[HT_DIR_NUM_ENTRIES]; i++)
+    {
+      fn(&entries[i * (length + HT_EXTRA_BYTES)]);
     }
   }
+}
+
+void Cracker::printBloom()
+{
+  // Every shard has its own filter
+  for (auto flat_hash_table : _flat_hash_tables)
+  {
+    size_t bloom_size = HashTable::BloomSize(flat_hash_table);
+    if (bloom_size == 0)
+      return;
+
+    cout << "Bloom filter: " << bloom_size << " bytes, false positive rate "
+         << HashTable::BloomFalsePositiveRate(flat_hash_table) * 100 << " %"
+         << endl;
+  }
+}
+
+void Cracker::PrintResults(const std::vector<unsigned> & sweep_thresholds)
+{
+  // Number of cracked passwords for every rank
+  vector<unsigned> num_cracked_passwords(HT_MAX_RANK + 1, 0);
+  vector<pair<unsigned, string>> cracked_passwords;
+
+  if (_cmd_queue.empty())
+  {
+    // Flags were set on host
+    for (auto flat_hash_table : _flat_hash_tables)
+      countCracked(flat_hash_table, num_cracked_passwords, cracked_passwords);
+  }
+
+  // Update flags in table of device's shard, every device has its own flags
+  vector<cl_uchar> found_flags;
+  for (unsigned i = 0; i < _cmd_queue.size(); i++)
+  {
+    unsigned shard = i % _flat_hash_tables.size();
+
+    found_flags.resize(_num_entries[shard]);
+    if (_num_entries[shard] > 0)
+      _cmd_queue[i].enqueueReadBuffer(_found_flags_buffer[i], CL_TRUE, 0,
+                                      _num_entries[shard], found_flags.data());
+
+    unsigned index = 0;
+    forEachEntry(_flat_hash_tables[shard], [&found_flags, &index] (cl_uchar *entry)
+    {
+      entry[HT_FLAG_OFFSET] = found_flags[index++];
+    });
+
+    countCracked(_flat_hash_tables[shard], num_cracked_passwords,
+                 cracked_passwords);
+  }
+
+  if (!_guess_curve.empty())
+    writeGuessCurve();
 
   // Print results
-  cout << "Cracked passwords: " << num_cracked_passwords << "\n";
+  if (sweep_thresholds.empty())
+  {
+    unsigned total = 0;
+    for (auto num : num_cracked_passwords)
+      total += num;
+
+    cout << "Cracked passwords: " << total << "\n";
+    for (auto pass : cracked_passwords)
+      cout << pass.second << "\n";
+
+    return;
+  }
+
+  // Password is generated with threshold t if all its ranks are below t
+  unsigned total = 0;
+  unsigned rank = 0;
+  for (auto threshold : sweep_thresholds)
+  {
+    for (; rank < threshold && rank < num_cracked_passwords.size(); rank++)
+      total += num_cracked_passwords[rank];
+
+    cout << "Cracked passwords (threshold " << threshold << "): " << total
+         << "\n";
+  }
+
+  // Print passwords with the lowest threshold which cracks them
   for (auto pass : cracked_passwords)
-    cout << pass << "\n";
+    cout << pass.first + 1 << "\t" << pass.second << "\n";
+}
+
+void Cracker::writeGuessCurve()
+{
+  // Password is counted by its first guess
+  sort(_hits.begin(), _hits.end(), [] (const Hit & h1, const Hit & h2)
+  {
+    return h1.global_index < h2.global_index;
+  });
+
+  vector<vector<bool>> cracked(_flat_hash_tables.size());
+  size_t num_entries = 0;
+
+  for (unsigned shard = 0; shard < _flat_hash_tables.size(); shard++)
+  {
+    cl_uchar *flat_hash_table = _flat_hash_tables[shard];
+    const cl_uint *directory = reinterpret_cast<const cl_uint *>(
+        flat_hash_table);
+
+    cracked[shard].assign(HashTable::NumEntries(flat_hash_table), false);
+
+    // Index keeps words of all lengths, fraction counts only the generated
+    // ones, so it's the same as with plain dictionary
+    for (unsigned length = _min_length; length <= _max_length; length++)
+      num_entries += directory[length * HT_DIR_FIELDS + HT_DIR_NUM_ENTRIES];
+  }
+
+  ofstream curve { _guess_curve, ofstream::out };
+  size_t num_cracked = 0;
+
+  curve << "guesses,cracked,fraction\n";
+  for (auto & hit : _hits)
+  {
+    if (cracked[hit.shard][hit.entry])
+      continue;
+
+    cracked[hit.shard][hit.entry] = true;
+    num_cracked++;
+
+    curve << hit.global_index - _first_index + 1 << "," << num_cracked << ","
+          << (double) num_cracked / num_entries << "\n";
+  }
+
+  if (!curve.good())
+    throw runtime_error { "Unable to write guess curve: " + _guess_curve };
+
+  if (_num_lost_hits > 0)
+    cout << "Guess curve misses " << _num_lost_hits
+         << " passwords, hit logs of batches were full\n";
+}
+
+void Cracker::countCracked(cl_uchar *flat_hash_table,
+                           std::vector<unsigned> & num_cracked_passwords,
+                           std::vector<std::pair<unsigned, std::string>> & cracked_passwords)
+{
+  forEachEntry(flat_hash_table, [this, &num_cracked_passwords, &cracked_passwords] (cl_uchar *entry)
+  {
+    if (entry[HT_FLAG_OFFSET] == HT_NOTFOUND)
+      return;
+
+    unsigned rank = entry[HT_FLAG_OFFSET] - HT_FOUND;
+    num_cracked_passwords[rank]++;
+    if (_print_passwords)
+      cracked_passwords.push_back(make_pair(rank, makeString(entry)));
+  });
 }
@@ -23,7 +23,11 @@
 
 #pragma OPENCL EXTENSION cl_amd_printf : enable
 
+#include "Hash.h"
+#include "PassSlot.h"
+
 #define CHARSET_SIZE 256
+#define MAX_PASS_LENGTH 50
 #define FLAG_NONE 0
 #define FLAG_END 1
 #define FLAG_CRACKED 2
@@ -35,45 +39,94 @@
 #define HT_PAYLOAD_OFFSET 2
 #define HT_FOUND 1
 #define HT_NOTFOUND 0
+#define HT_MAX_RANK 254
+#define HT_GROUP_SIZE 8
+#define HT_TAG_BITS 7
+#define HT_TAG_MASK 0x7F
+#define HT_OCCUPIED 0x80
+#define HT_DIR_TAGS 0
+#define HT_DIR_NUM_GROUPS 1
+#define HT_DIR_ENTRIES 2
+#define HT_DIR_NUM_ENTRIES 3
+#define HT_DIR_LAYOUT 4
+#define HT_DIR_SEED 5
+#define HT_DIR_FLAGS 6
+#define HT_DIR_FIELDS 7
+#define HT_DIR_DISPLACEMENTS 0
+#define HT_DIR_NUM_BUCKETS 1
+#define HT_LAYOUT_PERFECT 1
+#define HT_BLOOM_RECORD (MAX_PASS_LENGTH + 1)
+#define HT_BLOOM_OFFSET 0
+#define HT_BLOOM_NUM_BLOCKS 1
+#define HT_BLOOM_NUM_HASHES 2
+#define HT_SHARD_RECORD (MAX_PASS_LENGTH + 2)
+#define HT_SHARD_INDEX 0
+#define HT_SHARD_COUNT 1
+#define HT_NO_ENTRY 0xFFFFFFFFU
+#define HIT_FIELDS 2
+#define HIT_ENTRY 0
+#define HIT_INDEX 1
 
-#define PASS_EXTRA_BYTES 1
-#define PASS_PAYLOAD_OFFSET 1
+#define PASS_EXTRA_BYTES 2
+#define PASS_PAYLOAD_OFFSET 2
 #define PASS_LENGTH_OFFSET 0
+#define PASS_RANK_OFFSET 1
 
 /**
- * Calc index to hash table for given string
- * @param  str c string
- * @param  str_length length of string
- * @param  num_rows number of rows in hash table
- * @return row index
+ * Find slots in group whose tag equals to given one
+ * @return the highest bit of every matching byte is set
  */
-uint table_row_index (__global uchar *str, uchar str_length, uint num_rows)
+ulong match_tag (ulong group, uchar tag)
 {
-  uint hash = 5381;
+  // Matching bytes are zero after XOR, find them without carries between bytes
+  ulong low_bits = 0x7F7F7F7F7F7F7F7FUL;
+  ulong x = group ^ (0x0101010101010101UL * tag);
+
+  return ~(((x & low_bits) + low_bits) | x) & ~low_bits;
+}
 
-  for (int i = 0; i < str_length; i++)
+/**
+ * Copy Bloom filter of hash table into local memory, it must be called
+ * by all work-items of the work-group
+ */
+void load_bloom (__global const uchar *hash_table, __local ulong *bloom)
+{
+  __global const uint *record = (__global const uint *) hash_table
+      + HT_BLOOM_RECORD * HT_DIR_FIELDS;
+  __global const ulong *blocks = (__global const ulong *)
+      (hash_table + record[HT_BLOOM_OFFSET]);
+  uint num_blocks = record[HT_BLOOM_NUM_BLOCKS];
+
+  for (uint i = get_local_id(0); i < num_blocks; i += get_local_size(0))
   {
-    hash = ((hash << 5) + hash) + str[i];
+    bloom[i] = blocks[i];
   }
 
-  return hash % num_rows;
+  barrier(CLK_LOCAL_MEM_FENCE);
 }
 
 /**
- * Compare two strings
- * @return TRUE if the contents of both strings are equal, FALSE otherwise
+ * Test if the password can be in hash table according to Bloom filter
+ * @return FALSE if the password certainly isn't in hash table
  */
-bool strcmp (__global const uchar *str1, uchar str1_length,
-             __global const uchar *str2, uchar str2_length)
+bool bloom_contains (uint hash, __global const uchar *hash_table,
+                     __local const ulong *bloom)
 {
-  if (str1_length != str2_length)
+  __global const uint *record = (__global const uint *) hash_table
+      + HT_BLOOM_RECORD * HT_DIR_FIELDS;
+  uint num_blocks = record[HT_BLOOM_NUM_BLOCKS];
+
+  if (num_blocks == 0)
   {
-    return false;
+    return true;
   }
 
-  for (int i = 0; i < str1_length; i++)
+  ulong block = bloom[hash & (num_blocks - 1)];
+  uint state = hash;
+
+  for (uint i = 0; i < record[HT_BLOOM_NUM_HASHES]; i++)
   {
-    if (str1[i] != str2[i])
+    if (!(block & (1UL << hash_bloom_bit(&state))))
     {
       return false;
     }
@@ -82,38 +135,215 @@ bool strcmp (__global const uchar *str1, uchar str1_length,
   return true;
 }
 
-__kernel void cracker (__global uchar *passwords, uint password_entry_size,
-                       __global uchar *hash_table, uint num_rows,
-                       uint num_entries, uint entry_size, uint row_size)
+/**
+ * Append hit into log of the batch, hits over its capacity are only counted
+ * @param entry index of entry's flag
+ * @param global_index global index of the password
+ */
+void log_hit (uint entry, ulong global_index, __global ulong *hits,
+              __global uint *hit_cursor, uint hit_capacity)
 {
-  size_t id = get_global_id(0);
-  __global uchar *password = &passwords[id * password_entry_size];
-  uchar password_length = password[PASS_LENGTH_OFFSET];
+  uint position = atomic_inc(hit_cursor);
 
-  if (password_length == 0)
+  if (position < hit_capacity)
   {
-    return;
+    hits[position * HIT_FIELDS + HIT_ENTRY] = entry;
+    hits[position * HIT_FIELDS + HIT_INDEX] = global_index;
+  }
+}
+
+/**
+ * Find password in sub-table with minimal perfect hash, the password can be
+ * only in one slot and its fingerprint rejects most of other passwords
+ */
+uint lookup_perfect (const uchar *password, uchar password_length, uint rank,
+                     uint hash, __global const uint *sub_table,
+                     __global const uchar *hash_table,
+                     __global uchar *found_flags)
+{
+  uint num_buckets = sub_table[HT_DIR_NUM_BUCKETS];
+  __global const uint *displacements = (__global const uint *)
+      (hash_table + sub_table[HT_DIR_DISPLACEMENTS]);
+  __global const ushort *fingerprints = (__global const ushort *)
+      (displacements + num_buckets);
+
+  uint seed = sub_table[HT_DIR_SEED];
+  uint hash2 = 0;
+
+  // Second hash distinguishes words with the same hash in large sub-tables
+  if (seed != 0)
+  {
+    hash2 = hash_word_seed(password, password_length, seed);
+  }
+
+  uint slot = hash_perfect_slot(hash, hash2,
+                                displacements[hash_range(hash, num_buckets)],
+                                sub_table[HT_DIR_NUM_ENTRIES]);
+
+  if (fingerprints[slot] != (ushort) (hash ^ hash2))
+  {
+    return HT_NO_ENTRY;
+  }
+
+  __global const uchar *entry = hash_table + sub_table[HT_DIR_ENTRIES]
+      + slot * (password_length + HT_EXTRA_BYTES);
+
+  for (int i = 0; i < password_length; i++)
+  {
+    if (password[i] != entry[HT_PAYLOAD_OFFSET + i])
+    {
+      return HT_NO_ENTRY;
+    }
+  }
+
+  found_flags[sub_table[HT_DIR_FLAGS] + slot] = HT_FOUND
+      + min(rank, (uint) HT_MAX_RANK);
+  return sub_table[HT_DIR_FLAGS] + slot;
+}
+
+/**
+ * Find password in hash table and mark it as found, only the sub-table
+ * of password's length is searched and only if the table holds shard
+ * of the password
+ * @param password password in private memory
+ * @param rank highest rank of the password, stored in flag of the entry
+ * @param found_flags flags of entries of all sub-tables
+ * @param bloom Bloom filter loaded by load_bloom
+ * @return index of entry's flag or HT_NO_ENTRY if the password isn't
+ *         in hash table
+ */
+uint lookup (const uchar *password, uchar password_length, uint rank,
+             __global const uchar *hash_table, __global uchar *found_flags,
+             __local const ulong *bloom)
+{
+  __global const uint *sub_table = (__global const uint *) hash_table
+      + password_length * HT_DIR_FIELDS;
+  uint num_groups = sub_table[HT_DIR_NUM_GROUPS];
+
+  if (num_groups == 0)
+  {
+    return HT_NO_ENTRY;
   }
 
-  uint row_index = table_row_index(&password[PASS_PAYLOAD_OFFSET],
-                                   password_length, num_rows);
-  __global uchar *table_row = &hash_table[row_index * row_size];
+  uint hash = hash_word(password, password_length);
+  __global const uint *shard = (__global const uint *) hash_table
+      + HT_SHARD_RECORD * HT_DIR_FIELDS;
 
-  for (int i = 0; i < num_entries; i++)
+  // Password is owned by table of other device
+  if (hash_shard(hash, shard[HT_SHARD_COUNT]) != shard[HT_SHARD_INDEX])
   {
-    __global uchar *entry = &table_row[i * entry_size];
-    uchar entry_length = entry[HT_LENGTH_OFFSET];
+    return HT_NO_ENTRY;
+  }
+
+  if (!bloom_contains(hash, hash_table, bloom))
+  {
+    return HT_NO_ENTRY;
+  }
+
+  if (sub_table[HT_DIR_LAYOUT] == HT_LAYOUT_PERFECT)
+  {
+    return lookup_perfect(password, password_length, rank, hash, sub_table,
+                          hash_table, found_flags);
+  }
+
+  uchar tag = HT_OCCUPIED | (hash & HT_TAG_MASK);
+  uint group_index = hash >> HT_TAG_BITS;
+  uint entry_size = password_length + HT_EXTRA_BYTES;
+
+  __global const ulong *tags = (__global const ulong *)
+      (hash_table + sub_table[HT_DIR_TAGS]);
+  __global const uint *indexes = (__global const uint *)
+      (tags + num_groups);
+  __global const uchar *entries = hash_table + sub_table[HT_DIR_ENTRIES];
+
+  for (uint probe = 0; probe < num_groups; probe++, group_index++)
+  {
+    group_index &= num_groups - 1;
+    ulong group = tags[group_index];
+    ulong matches = match_tag(group, tag);
 
-    if (entry_length == 0)
+    // Compare words only in slots with matching tag, all have the same length
+    while (matches != 0)
     {
-      break;
+      uint slot = (uint) (63 - clz(matches & -matches)) / 8;
+      uint index = indexes[group_index * HT_GROUP_SIZE + slot];
+      __global const uchar *entry = &entries[index * entry_size];
+      int i = 0;
+
+      while (i < password_length && password[i] == entry[HT_PAYLOAD_OFFSET + i])
+        i++;
+
+      if (i == password_length)
+      {
+        found_flags[sub_table[HT_DIR_FLAGS] + index] = HT_FOUND
+            + min(rank, (uint) HT_MAX_RANK);
+        return sub_table[HT_DIR_FLAGS] + index;
+      }
+
+      matches &= matches - 1;
     }
 
-    if (strcmp(&password[PASS_PAYLOAD_OFFSET], password_length,
-               &entry[HT_PAYLOAD_OFFSET], entry_length))
+    // Password would be in this group if there is an empty slot
+    if (~group & 0x8080808080808080UL)
     {
-      entry[HT_FLAG_OFFSET] = HT_FOUND;
-      return;
+      return HT_NO_ENTRY;
     }
   }
+
+  return HT_NO_ENTRY;
+}
+
+/**
+ * Look up generated passwords, password i of the buffer has global index
+ * index_start + i, hits are appended to log of the batch. Passwords are
+ * in slots of PASS_SLOT_SIZE(length) bytes, host sets it for every batch.
+ */
+__kernel void cracker (__global uchar *passwords, uint slot_size,
+                       __global const uchar *hash_table,
+                       __global uchar *found_flags, __local ulong *bloom,
+                       __global ulong *hits, __global uint *hit_cursor,
+                       uint hit_capacity, ulong index_start)
+{
+  size_t id = get_global_id(0);
+  __global uchar *password = &passwords[id * slot_size];
+  uchar password_length = password[PASS_LENGTH_OFFSET];
+  uchar record[PASS_SLOT_SIZE(MAX_PASS_LENGTH)];
+
+  load_bloom(hash_table, bloom);
+
+  if (password_length == 0)
+  {
+    return;
+  }
+
+  // Copy password into private memory, it's compared with several entries
+  load_slot(password, slot_size, record);
+
+  uint entry = lookup(record + PASS_PAYLOAD_OFFSET, password_length,
+                      record[PASS_RANK_OFFSET], hash_table, found_flags, bloom);
+
+  if (entry != HT_NO_ENTRY)
+  {
+    log_hit(entry, index_start + id, hits, hit_cursor, hit_capacity);
+  }
+}
+
+/**
+ * Hash words stored in the layout of generated passwords, host compares
+ * the hashes with its own ones
+ */
+__kernel void hashWords (__global uchar *words, uint word_entry_size,
+                         __global uint *hashes)
+{
+  size_t id = get_global_id(0);
+  __global uchar *word = &words[id * word_entry_size];
+  uchar length = word[PASS_LENGTH_OFFSET];
+  uchar str[MAX_PASS_LENGTH];
+
+  for (int i = 0; i < length; i++)
+  {
+    str[i] = word[i + PASS_PAYLOAD_OFFSET];
+  }
+
+  hashes[id] = hash_word(str, length);
 }
@@ -25,49 +25,282 @@
 #define CRACKER_H_
 
 #include "HashTable.h"
+#include "Constants.h"
+#include "MappedFile.h"
+#include "DictionaryReader.h"
 
 #define __CL_ENABLE_EXCEPTIONS
 
 #include <CL/cl.hpp>
 
 #include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <chrono>
+
+// Record of hit in log of batch, entry is index of entry's flag in its shard
+#define HIT_FIELDS 2
+#define HIT_ENTRY 0
+#define HIT_INDEX 1
 
 class Cracker
 {
 public:
   struct Options
   {
+    /**
+     * Dictionary with one word per line or index written by StoreIndex
+     */
     std::string dictionary;
-    float max_load_factor = 1.0;
+    /**
+     * Maximal load factor of the hash table (index keeps its own layout,
+     * so it must not be changed then)
+     */
+    float max_load_factor = 0.875;
     bool print_passwords = false;
+    /**
+     * Range of generated lengths, other words are skipped
+     */
+    unsigned min_length = MIN_PASS_LENGTH;
+    unsigned max_length = MAX_PASS_LENGTH;
+    /**
+     * Bits of Bloom filter per word, filter rejects most of the generated
+     * passwords in local memory (0 disables it, must not be changed with
+     * index)
+     */
+    unsigned bloom_bits = 0;
+    /**
+     * Build minimal perfect hash for dictionary instead of open addressing
+     * (must not be set with index)
+     */
+    bool perfect_hash = false;
+    /**
+     * Dictionary is split by hash into this number of tables and device i
+     * holds only table i % shards, so the dictionary can be larger than
+     * memory of single device (index keeps its own number of shards)
+     */
+    unsigned shards = 1;
+    /**
+     * CSV file with number of cracked passwords after every successful
+     * guess (empty if disabled)
+     */
+    std::string guess_curve;
+    /**
+     * Global index of the first generated password, guesses are counted
+     * from it
+     */
+    cl_ulong first_index = 0;
   };
 
   Cracker(Options options);
   ~Cracker();
 
+  /**
+   * Write serialized hash table into index file, which can be used instead
+   * of dictionary in later runs
+   */
+  void StoreIndex(const std::string & path);
+
+  /**
+   * Return number of shards of dictionary, devices holding the same shard
+   * split the keyspace and every shard has to see all passwords
+   */
+  unsigned NumShards();
+
   std::string GetKernelSource();
   std::string GetKernelName();
 
+  /**
+   * Create buffers and set arguments, table of every shard is uploaded once
+   * for all its devices and every device has its own flags of cracked
+   * passwords. CPU devices use host memory directly, tables are allocated
+   * and stored in index at HT_PAGE_SIZE boundary and padded to a multiple
+   * of it as CL_MEM_USE_HOST_PTR needs for zero copy. Bloom filter is shrunk
+   * to fit local memory of every device
+   * @param first_arg index of the first argument belonging to cracker
+   * @param num_slots number of batches in flight on every device, every
+   *        batch appends hits to its own log
+   */
   void InitKernel(std::vector<cl::Kernel> & kernels, std::vector<cl::CommandQueue> & queue,
-                  cl::Context & context);
+                  cl::Context & context, unsigned first_arg = 2,
+                  unsigned num_slots = 1);
+
+  /**
+   * Set log of given slot as argument of device's kernel for next batch and
+   * enqueue reset of its cursor, log has to be drained
+   * @param events event of the reset is appended, the batch has to wait
+   *        for it
+   */
+  void SetHitLog(unsigned device_number, unsigned slot,
+                 std::vector<cl::Event> & events);
+
+  /**
+   * Enqueue non-blocking read of log of given slot, which starts when
+   * the batch is done
+   */
+  void ReadHitLog(unsigned device_number, unsigned slot,
+                  const std::vector<cl::Event> & batch_events);
+
+  /**
+   * Wait for read of log of given slot and collect its hits, number of
+   * cracked passwords is reported during the run
+   */
+  void DrainHitLog(unsigned device_number, unsigned slot);
 
   void Details();
+
+  /**
+   * Mark passwords in dictionary as cracked on host, without any kernel
+   * @param is_generated predicate deciding if the password would be generated,
+   *        it also returns rank of the password for sweep mode and its
+   *        global index
+   */
+  void Evaluate(const std::function<bool(const cl_uchar *, unsigned,
+                                         unsigned &, cl_ulong &)> & is_generated);
+
+  /**
+   * Look up passwords in hash table on host, the layout of the passwords is
+   * same as in cracker's kernel
+   * @param passwords buffer with count * entry_size bytes
+   * @param global_index global index of the first password
+   */
+  void Crack(const cl_uchar *passwords, unsigned entry_size, unsigned count,
+             cl_ulong global_index);
+
   /**
    * Print number of cracked passwords
+   * @param sweep_thresholds print number of cracked passwords for every
+   *        of these thresholds (optional)
    */
-  void PrintResults();
+  void PrintResults(const std::vector<unsigned> & sweep_thresholds);
 
 private:
+  /**
+   * Header of dictionary index, it's padded to HT_PAGE_SIZE and followed by
+   * serialized tables of all shards
+   */
+  struct IndexHeader
+  {
+    char magic[8];
+    uint64_t hash_table_size;
+  };
+
+  /**
+   * Log of hits of one batch in flight, cursor counts all hits of the batch
+   * even if the log is full. Cursor and the beginning of the log are read
+   * as soon as the batch is done
+   */
+  struct HitLog
+  {
+    cl::Buffer hits;
+    cl::Buffer cursor;
+    cl_uint num_hits;
+    std::vector<cl_ulong> records;
+    std::vector<cl::Event> read_events;
+  };
+
+  /**
+   * Cracked password with global index of the guess which cracked it
+   */
+  struct Hit
+  {
+    unsigned shard;
+    cl_uint entry;
+    cl_ulong global_index;
+  };
+
   const std::string _kernel_name = "cracker";
   const std::string _kernel_source = "kernels/Cracker.cl";
+  /**
+   * Local memory left for other variables of kernels
+   */
+  const std::size_t _local_memory_reserve = 1024;
+  const char _index_magic[8] = "WDICT4";
+  const std::size_t _index_version_offset = 5;
+  /**
+   * Maximal number of hits in log of single batch, further hits are only
+   * counted
+   */
+  const cl_uint _max_hit_capacity = 1 << 20;
+  /**
+   * Number of hits read together with the cursor, rest of larger logs is
+   * read when they are drained
+   */
+  const cl_uint _max_hit_prefetch = 4096;
+  /**
+   * Number of cracked passwords is printed at most once per this number
+   * of seconds
+   */
+  const double _report_interval = 1.0;
 
   std::vector<cl::CommandQueue> _cmd_queue;
+  /**
+   * Table of every shard, tables are read-only for kernels, so all devices
+   * of context holding the shard share it
+   */
   std::vector<cl::Buffer> _hash_table_buffer;
-  unsigned _hash_table_size;
-  cl_uchar *_flat_hash_table;
-  cl_uint _num_rows, _num_entries, _entry_size, _row_size;
+  /**
+   * Flags of entries for every device
+   */
+  std::vector<cl::Buffer> _found_flags_buffer;
+  std::vector<cl::Kernel> _kernels;
+  unsigned _first_arg;
+  /**
+   * Hit logs of every device, one for each batch in flight
+   */
+  std::vector<std::vector<HitLog>> _hit_logs;
+  std::vector<cl_uint> _hit_capacity;
+  /**
+   * Number of entries of every shard
+   */
+  std::vector<std::size_t> _num_entries;
+  /**
+   * Size of all shards in bytes
+   */
+  std::size_t _hash_table_size = 0;
+  std::vector<cl_uchar *> _flat_hash_tables;
+  /**
+   * Mapped index which the table points to, if it was loaded from index
+   */
+  std::unique_ptr<MappedFile> _index_file;
 
   bool _print_passwords;
+  std::string _guess_curve;
+  cl_ulong _first_index;
+  /**
+   * Range of generated lengths
+   */
+  unsigned _min_length;
+  unsigned _max_length;
+
+  /**
+   * Hits drained from devices or found on host, in any order
+   */
+  std::vector<Hit> _hits;
+  std::size_t _num_lost_hits = 0;
+  std::mutex _hits_mutex;
+  std::chrono::steady_clock::time_point _last_report;
+
+  /**
+   * Call function for every entry in all sub-tables of the flat hash table
+   */
+  void forEachEntry(cl_uchar *flat_hash_table,
+                    const std::function<void(cl_uchar *)> & fn);
+  /**
+   * Return index of entry's flag in its table, as it's logged by kernels
+   */
+  static cl_uint entryIndex(const cl_uchar *flat_hash_table,
+                            const cl_uchar *entry);
+  void addHits(const std::vector<Hit> & hits, std::size_t num_lost);
+  void writeGuessCurve();
+  void buildHashTable(Options & options);
+  bool loadIndex(const std::string & path);
+  void printBloom();
+  void countCracked(cl_uchar *flat_hash_table,
+                    std::vector<unsigned> & num_cracked_passwords,
+                    std::vector<std::pair<unsigned, std::string>> & cracked_passwords);
 };
 
 #endif /* CRACKER_H_ */
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2016 Peter Gazdik
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <DictionaryReader.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+DictionaryReader::DictionaryReader(const std::string & file_name)
+{
+#ifdef HAVE_ZLIB
+  // Uncompressed files are read by zlib as they are
+  _file = gzopen(file_name.c_str(), "rb");
+  if (_file == nullptr)
+    throw runtime_error { "Unable to open file: " + file_name };
+
+  gzbuffer(_file, 1 << 20);
+#else
+  const string gz_suffix = ".gz";
+  if (file_name.size() >= gz_suffix.size()
+      && file_name.compare(file_name.size() - gz_suffix.size(),
+                           gz_suffix.size(), gz_suffix) == 0)
+    throw runtime_error { "Compressed dictionary needs zlib: " + file_name };
+
+  _file.open(file_name, ifstream::in | ifstream::binary);
+  if (!_file.is_open())
+    throw runtime_error { "Unable to open file: " + file_name };
+#endif
+}
+
+DictionaryReader::~DictionaryReader()
+{
+#ifdef HAVE_ZLIB
+  gzclose(_file);
+#endif
+}
+
+bool DictionaryReader::Read(std::vector<char> & block)
+{
+  block.swap(_rest);
+  _rest.clear();
+
+  // Line longer than block is read whole
+  while (!_eof)
+  {
+    size_t size = block.size();
+    block.resize(size + _block_size);
+    size += readRaw(&block[size], _block_size);
+    block.resize(size);
+
+    auto line_end = find(block.rbegin(), block.rend(), '\n');
+    if (_eof || line_end != block.rend())
+    {
+      // Incomplete line is left for the next block
+      if (!_eof)
+        _rest.assign(line_end.base(), block.end());
+      block.resize(block.size() - _rest.size());
+      break;
+    }
+  }
+
+  return !block.empty();
+}
+
+uint64_t DictionaryReader::BytesRead() const
+{
+  return _bytes_read;
+}
+
+std::size_t DictionaryReader::readRaw(char *buffer, std::size_t size)
+{
+#ifdef HAVE_ZLIB
+  int result = gzread(_file, buffer, size);
+  if (result < 0)
+    throw runtime_error { "Unable to decompress dictionary" };
+
+  size_t count = result;
+#else
+  _file.read(buffer, size);
+  size_t count = _file.gcount();
+#endif
+
+  if (count < size)
+    _eof = true;
+
+  _bytes_read += count;
+  return count;
+}
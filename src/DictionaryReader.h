@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2016 Peter Gazdik
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef DICTIONARYREADER_H_
+#define DICTIONARYREADER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/**
+ * Sequential reader of dictionary in large blocks of whole lines, so that
+ * the blocks can be parsed independently. Files compressed by gzip are
+ * decompressed on the fly (requires zlib).
+ */
+class DictionaryReader
+{
+public:
+  DictionaryReader(const std::string & file_name);
+  ~DictionaryReader();
+
+  DictionaryReader(const DictionaryReader &) = delete;
+  DictionaryReader & operator=(const DictionaryReader &) = delete;
+
+  /**
+   * Read next block, it ends with the end of line or the end of file
+   * @param block output buffer
+   * @return FALSE if there is nothing more to read
+   */
+  bool Read(std::vector<char> & block);
+
+  /**
+   * Return number of (decompressed) bytes read so far
+   */
+  uint64_t BytesRead() const;
+
+private:
+  const std::size_t _block_size = 64 << 20;
+
+#ifdef HAVE_ZLIB
+  gzFile _file;
+#else
+  std::ifstream _file;
+#endif
+  /**
+   * Incomplete last line of previous block
+   */
+  std::vector<char> _rest;
+  bool _eof = false;
+  uint64_t _bytes_read = 0;
+
+  std::size_t readRaw(char *buffer, std::size_t size);
+};
+
+#endif /* DICTIONARYREADER_H_ */
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2016 Peter Gazdik
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Fused generator and cracker. It's compiled together with CLMarkovPassGen.cl
+ * and Cracker.cl, which provide password generation and hash table lookup.
+ */
+
+/**
+ * Generate per_item consecutive passwords of given length from local index
+ * in private memory and look them up in hash table immediately
+ */
+void crack_passwords (uint length, ulong index, ulong index_stop, uint per_item,
+                      MARKOV_TABLE uchar *markov_table,
+                      __constant uint *thresholds,
+                      __constant ulong *permutations, uint max_threshold,
+                      uint sweep_from, __global const uchar *hash_table,
+                      __global uchar *found_flags, __local const ulong *bloom,
+                      __global ulong *hits, __global uint *hit_cursor,
+                      uint hit_capacity)
+{
+  ushort digits[MAX_PASS_LENGTH];
+  uchar password[MAX_PASS_LENGTH];
+  uint rank;
+  uint entry;
+
+  if (index >= index_stop)
+  {
+    return;
+  }
+
+  // Hits are logged by global index
+  ulong first_index = permutations[length - 1];
+
+  decode_digits(index, length, thresholds, permutations, digits);
+
+  for (uint k = 0; k < per_item && index < index_stop; k++)
+  {
+    rank = create_password(password, digits, length, markov_table,
+                           max_threshold, sweep_from);
+
+    entry = lookup(password, length, rank, hash_table, found_flags, bloom);
+
+    if (entry != HT_NO_ENTRY)
+    {
+      log_hit(entry, first_index + index, hits, hit_cursor, hit_capacity);
+    }
+
+    index++;
+    next_digits(digits, length, thresholds);
+  }
+}
+
+/**
+ * Generate per_item consecutive passwords and look them up in hash table.
+ * Arguments are the generator's ones followed by number of passwords
+ * per work-item and the cracker's ones.
+ */
+__kernel void markovCracker (MARKOV_TABLE uchar *markov_table,
+                    __constant uint *thresholds, __constant ulong *permutations,
+                    uint max_threshold, uint length, ulong index_start,
+                    ulong index_stop, uint sweep_from, uint per_item,
+                    __global const uchar *hash_table, __global uchar *found_flags,
+                    __local ulong *bloom, __global ulong *hits,
+                    __global uint *hit_cursor, uint hit_capacity)
+{
+  ulong index = index_start + get_global_id(0) * per_item;
+
+  load_bloom(hash_table, bloom);
+
+  crack_passwords(length, index, index_stop, per_item, markov_table,
+                  thresholds, permutations, max_threshold, sweep_from,
+                  hash_table, found_flags, bloom, hits, hit_cursor,
+                  hit_capacity);
+}
+
+/**
+ * Persistent variant of markovCracker. Fixed number of work-groups pulls
+ * chunks of local size * per_item passwords from chunk_counter until the
+ * range is exhausted. Host has to zero the counter before every launch.
+ */
+__kernel void markovCrackerPersistent (MARKOV_TABLE uchar *markov_table,
+                    __constant uint *thresholds, __constant ulong *permutations,
+                    uint max_threshold, uint length, ulong index_start,
+                    ulong index_stop, uint sweep_from, uint per_item,
+                    __global const uchar *hash_table, __global uchar *found_flags,
+                    __local ulong *bloom, __global ulong *hits,
+                    __global uint *hit_cursor, uint hit_capacity,
+                    __global uint *chunk_counter)
+{
+  __local uint chunk;
+  ulong chunk_size = get_local_size(0) * per_item;
+  ulong chunk_start;
+
+  load_bloom(hash_table, bloom);
+
+  while (true)
+  {
+    if (get_local_id(0) == 0)
+      chunk = atomic_inc(chunk_counter);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    chunk_start = index_start + chunk * chunk_size;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (chunk_start >= index_stop)
+      return;
+
+    crack_passwords(length, chunk_start + get_local_id(0) * per_item,
+                    index_stop, per_item, markov_table, thresholds,
+                    permutations, max_threshold, sweep_from, hash_table,
+                    found_flags, bloom, hits, hit_cursor, hit_capacity);
+  }
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2016 Peter Gazdik
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Hash of dictionary words shared by host code and kernels. It's 32-bit
+ * MurmurHash3, the word is read 4 bytes at a time in little-endian order
+ * on every platform and its characters are always unsigned.
+ */
+
+#ifndef HASH_H_
+#define HASH_H_
+
+#ifdef __OPENCL_VERSION__
+#define HASH_UINT uint
+#define HASH_UCHAR uchar
+#define HASH_INLINE
+#else
+#include <cstdint>
+#define HASH_UINT uint32_t
+#define HASH_UCHAR uint8_t
+#define HASH_INLINE inline
+#endif
+
+#define HASH_SEED 0x9747b28cU
+#define HASH_SHARD_SEED 0x2545f491U
+
+HASH_INLINE HASH_UINT hash_rotl (HASH_UINT x, HASH_UINT r)
+{
+  return (x << r) | (x >> (32 - r));
+}
+
+HASH_INLINE HASH_UINT hash_mix (HASH_UINT k)
+{
+  k *= 0xcc9e2d51U;
+  k = hash_rotl(k, 15);
+  return k * 0x1b873593U;
+}
+
+/**
+ * Final mix of MurmurHash3, every input bit affects every output bit
+ */
+HASH_INLINE HASH_UINT hash_fmix (HASH_UINT hash)
+{
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bU;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35U;
+  hash ^= hash >> 16;
+
+  return hash;
+}
+
+/**
+ * Map hash uniformly to range [0, n) by its high bits
+ */
+HASH_INLINE HASH_UINT hash_range (HASH_UINT hash, HASH_UINT n)
+{
+#ifdef __OPENCL_VERSION__
+  return mul_hi(hash, n);
+#else
+  return (HASH_UINT) (((uint64_t) hash * n) >> 32);
+#endif
+}
+
+/**
+ * Shard of dictionary which owns the word, hash is mixed again so that
+ * words of a shard are spread over all buckets and groups of its sub-tables
+ */
+HASH_INLINE HASH_UINT hash_shard (HASH_UINT hash, HASH_UINT num_shards)
+{
+  return hash_range(hash_fmix(hash ^ HASH_SHARD_SEED), num_shards);
+}
+
+/**
+ * Calc hash of given string
+ * @param str string (not terminated)
+ * @param length length of string
+ * @param seed initial value, different seeds give independent hashes
+ */
+HASH_INLINE HASH_UINT hash_word_seed (const HASH_UCHAR *str, HASH_UINT length,
+                                      HASH_UINT seed)
+{
+  HASH_UINT hash = seed;
+  HASH_UINT i = 0;
+  HASH_UINT k;
+
+  for (; i + 4 <= length; i += 4)
+  {
+    k = (HASH_UINT) str[i] | ((HASH_UINT) str[i + 1] << 8)
+        | ((HASH_UINT) str[i + 2] << 16) | ((HASH_UINT) str[i + 3] << 24);
+
+    hash ^= hash_mix(k);
+    hash = hash_rotl(hash, 13);
+    hash = hash * 5 + 0xe6546b64U;
+  }
+
+  // Remaining 1-3 bytes
+  k = 0;
+  if ((length & 3) == 3)
+    k ^= (HASH_UINT) str[i + 2] << 16;
+  if ((length & 3) >= 2)
+    k ^= (HASH_UINT) str[i + 1] << 8;
+  if ((length & 3) >= 1)
+    hash ^= hash_mix(k ^ str[i]);
+
+  return hash_fmix(hash ^ length);
+}
+
+HASH_INLINE HASH_UINT hash_word (const HASH_UCHAR *str, HASH_UINT length)
+{
+  return hash_word_seed(str, length, HASH_SEED);
+}
+
+/**
+ * Next bit in block of Bloom filter, state is initialized by hash of word
+ * @return index of bit in 64-bit block
+ */
+HASH_INLINE HASH_UINT hash_bloom_bit (HASH_UINT *state)
+{
+  *state *= 0x9e3779b1U;
+  return *state >> 26;
+}
+
+/**
+ * Slot of word in perfect sub-table, words of a bucket share displacement
+ * which was chosen so that their slots don't collide with any other word
+ * @param hash hash of word, it also selects the bucket
+ * @param hash2 hash of word with seed of sub-table, or 0 if the sub-table
+ *        has no seed because all hashes are unique
+ */
+HASH_INLINE HASH_UINT hash_perfect_slot (HASH_UINT hash, HASH_UINT hash2,
+                                         HASH_UINT displacement,
+                                         HASH_UINT num_slots)
+{
+  HASH_UINT x = hash_fmix(hash ^ (displacement * 0x9e3779b9U));
+
+  return hash_range(hash_fmix(x ^ hash2), num_slots);
+}
+
+#endif /* HASH_H_ */
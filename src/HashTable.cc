@@ -24,16 +24,39 @@
 
 #include "HashTable.h"
 
+#include "Hash.h"
+
 #include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 
 using namespace std;
 
-HashTable::HashTable(unsigned num_words, float max_load_factor)
+HashTable::HashTable(float max_load_factor, unsigned min_length,
+                     unsigned max_length, unsigned bloom_bits,
+                     bool perfect_hash) :
+    _min_length { min_length },
+    _max_length { min(max_length, (unsigned) MAX_PASS_LENGTH) },
+    _num_skipped { 0 }, _bloom_bits { bloom_bits },
+    _perfect_hash { perfect_hash },
+    _max_load_factor { min(max_load_factor, 0.875f) }
 {
-  size_t buckets = num_words;
+  if (_max_load_factor <= 0)
+    throw invalid_argument("Invalid value for argument 'load-factor'");
 
-  _hash_table.max_load_factor(max_load_factor);
-  _hash_table.rehash(buckets);
+  for (unsigned length = 0; length <= MAX_PASS_LENGTH; length++)
+  {
+    for (unsigned i = 0; i < (1u << HT_STRIPE_BITS); i++)
+      _stripes.emplace_back(new Stripe { length });
+  }
 }
 
 HashTable::~HashTable()
@@ -42,115 +65,648 @@ HashTable::~HashTable()
 
 void HashTable::Insert(std::string & value)
 {
-  if (value.length() > _max_length)
-    _max_length = value.length();
+  Insert(reinterpret_cast<const cl_uchar *>(value.data()), value.length());
+}
+
+void HashTable::Insert(const cl_uchar *str, unsigned length)
+{
+  // Words of other lengths are never generated
+  if (length == 0 || length < _min_length || length > _max_length)
+  {
+    _num_skipped++;
+    return;
+  }
+
+  Word word { str, Hash(str, length) };
+  Stripe & stripe = *_stripes[(length << HT_STRIPE_BITS)
+      + (word.hash >> (32 - HT_STRIPE_BITS))];
+
+  lock_guard<mutex> lock { stripe.mutex };
+
+  if (stripe.words.count(word) != 0)
+    return;
 
-  _hash_table.insert(value);
+  word.str = stripe.store(str, length);
+  stripe.words.insert(word);
 }
 
-unsigned HashTable::GetEntryLength()
+HashTable::Stripe::Stripe(unsigned length) :
+    words { 0, hash_func { }, equal_func { length } },
+    block_used { _stripe_block_size }
 {
-  return (_max_length + HT_EXTRA_BYTES);
 }
 
-unsigned HashTable::GetBucketCount()
+const cl_uchar * HashTable::Stripe::store(const cl_uchar *str, unsigned length)
 {
-  return (_hash_table.bucket_count());
+  if (block_used + length > _stripe_block_size)
+  {
+    blocks.emplace_back(new cl_uchar[_stripe_block_size]);
+    block_used = 0;
+  }
+
+  cl_uchar *stored = &blocks.back()[block_used];
+  memcpy(stored, str, length);
+  block_used += length;
+
+  return stored;
+}
+
+std::size_t HashTable::numWords(unsigned length)
+{
+  size_t num_words = 0;
+
+  if (_num_shards > 1)
+  {
+    forEachWord(length, [&num_words] (const Word &)
+    {
+      num_words++;
+    });
+
+    return num_words;
+  }
+
+  for (unsigned i = 0; i < (1u << HT_STRIPE_BITS); i++)
+    num_words += _stripes[(length << HT_STRIPE_BITS) + i]->words.size();
+
+  return num_words;
 }
 
+void HashTable::forEachWord(unsigned length,
+                            const std::function<void(const Word &)> & fn)
+{
+  for (unsigned i = 0; i < (1u << HT_STRIPE_BITS); i++)
+  {
+    for (auto & word : _stripes[(length << HT_STRIPE_BITS) + i]->words)
+    {
+      if (_num_shards == 1 || ShardOf(word.hash, _num_shards) == _shard)
+        fn(word);
+    }
+  }
+}
 
-unsigned HashTable::Serialize(cl_uchar** hash_table, cl_uint& num_rows,
-                              cl_uint& num_entries, cl_uint& entry_size,
-                              cl_uint& row_size)
+std::size_t HashTable::Serialize(cl_uchar** hash_table, unsigned shard,
+                                 unsigned num_shards)
 {
-  num_rows = _hash_table.bucket_count();
-  entry_size = GetEntryLength();
-  num_entries = longestBucketSize();
+  cl_uint directory[HT_DIR_RECORDS][HT_DIR_FIELDS] = { };
+  size_t offset = align(sizeof(directory));
+  size_t total_words = 0;
 
-  row_size = entry_size * num_entries;
+  if (num_shards == 0 || shard >= num_shards)
+    throw invalid_argument("Invalid value for argument 'shards'");
 
-  unsigned hash_table_size = num_rows * row_size;
+  _shard = shard;
+  _num_shards = num_shards;
+  directory[HT_SHARD_RECORD][HT_SHARD_INDEX] = shard;
+  directory[HT_SHARD_RECORD][HT_SHARD_COUNT] = num_shards;
 
-  cl_uchar *hash_table_ptr = new cl_uchar[hash_table_size];
-  *hash_table = hash_table_ptr;
-  memset(hash_table_ptr, 0, hash_table_size * sizeof(cl_uchar));
+  for (unsigned length = 0; length <= MAX_PASS_LENGTH; length++)
+    total_words += numWords(length);
+
+  // Bloom filter has power of two number of blocks, about 0.7 hashes per bit
+  // of word is optimal
+  if (_bloom_bits > 0)
+  {
+    size_t num_blocks = 1;
+    while (num_blocks * 64 < total_words * _bloom_bits)
+      num_blocks *= 2;
+
+    directory[HT_BLOOM_RECORD][HT_BLOOM_OFFSET] = offset;
+    directory[HT_BLOOM_RECORD][HT_BLOOM_NUM_BLOCKS] = num_blocks;
+    directory[HT_BLOOM_RECORD][HT_BLOOM_NUM_HASHES] =
+        max(1u, min(_max_bloom_hashes, _bloom_bits * 7 / 10));
+    offset += num_blocks * sizeof(uint64_t);
+  }
+
+  // Displacements and slots of words of perfect sub-tables
+  vector<vector<uint32_t>> displacements(MAX_PASS_LENGTH + 1);
+  vector<vector<uint32_t>> slots(MAX_PASS_LENGTH + 1);
+  uint32_t seed;
+  cl_uint num_entries = 0;
 
-  unsigned bucket_size;
-  cl_uchar *row;
-  cl_uchar *entry;
-  for (unsigned i = 0; i < num_rows; i++)
+  // Place sub-tables, number of groups is the smallest power of two within
+  // maximal load factor
+  for (unsigned length = 0; length <= MAX_PASS_LENGTH; length++)
   {
-    row = &hash_table_ptr[i * row_size];
-    bucket_size = _hash_table.bucket_size(i);
+    size_t num_words = numWords(length);
+    if (num_words == 0)
+      continue;
 
-    if (bucket_size == 0)
+    if (_perfect_hash
+        && buildPerfect(length, displacements[length], slots[length], seed))
     {
-      row[HT_LENGTH_OFFSET] = 0;
+      directory[length][HT_DIR_LAYOUT] = HT_LAYOUT_PERFECT;
+      directory[length][HT_DIR_SEED] = seed;
+      _num_perfect++;
+      directory[length][HT_DIR_DISPLACEMENTS] = offset;
+      directory[length][HT_DIR_NUM_BUCKETS] = displacements[length].size();
+      offset = align(offset + displacements[length].size() * sizeof(cl_uint)
+          + num_words * sizeof(uint16_t));
+
+      directory[length][HT_DIR_ENTRIES] = offset;
+      directory[length][HT_DIR_NUM_ENTRIES] = num_words;
+      directory[length][HT_DIR_FLAGS] = num_entries;
+      offset = align(offset + num_words * (length + HT_EXTRA_BYTES));
+      num_entries += num_words;
+
+      if (offset > UINT32_MAX)
+        throw runtime_error { "Dictionary is too large, use more shards" };
+
       continue;
     }
 
-    unsigned j = 0;
-    char length;
-    for (auto it = _hash_table.begin(i); it != _hash_table.end(i); it++)
-    {
-      string word = *it;
-      entry = &row[j * entry_size];
+    if (_perfect_hash)
+      _perfect_fallback[length] = true;
 
-      length = word.length();
-      if (length == 0)
-        continue;
+    size_t min_slots = num_words / _max_load_factor + 1;
+    size_t num_groups = 1;
+    while (num_groups * HT_GROUP_SIZE < min_slots)
+      num_groups *= 2;
 
-      entry[HT_LENGTH_OFFSET] = length;
+    directory[length][HT_DIR_TAGS] = offset;
+    directory[length][HT_DIR_NUM_GROUPS] = num_groups;
+    offset += num_groups * HT_GROUP_SIZE * (1 + sizeof(cl_uint));
 
-      for (int i = 0; i < length; i++)
-      {
-        entry[i + HT_PAYLOAD_OFFSET] = word[i];
-      }
+    directory[length][HT_DIR_ENTRIES] = offset;
+    directory[length][HT_DIR_NUM_ENTRIES] = num_words;
+    directory[length][HT_DIR_FLAGS] = num_entries;
+    offset = align(offset + num_words * (length + HT_EXTRA_BYTES));
+    num_entries += num_words;
 
-      j++;
-    }
+    if (offset > UINT32_MAX)
+      throw runtime_error { "Dictionary is too large, use more shards" };
+  }
 
-    // TODO What is it?
-    if (j < num_entries)
+  // Tables of shards follow each other in index, each of them stays aligned
+  offset = (offset + HT_PAGE_SIZE - 1) & ~size_t { HT_PAGE_SIZE - 1 };
+  if (offset > UINT32_MAX)
+    throw runtime_error { "Dictionary is too large, use more shards" };
+
+  directory[HT_SHARD_RECORD][HT_SHARD_SIZE] = offset;
+  _hash_table_size += offset;
+
+  cl_uchar *hash_table_ptr = Allocate(offset);
+  *hash_table = hash_table_ptr;
+  memset(hash_table_ptr, 0, offset * sizeof(cl_uchar));
+  memcpy(hash_table_ptr, directory, sizeof(directory));
+
+  for (unsigned length = 0; length <= MAX_PASS_LENGTH; length++)
+  {
+    if (directory[length][HT_DIR_LAYOUT] == HT_LAYOUT_PERFECT)
     {
-      entry = &row[j * entry_size];
-      entry[HT_LENGTH_OFFSET] = 0;
+      serializePerfect(hash_table_ptr, length, displacements[length],
+                       slots[length]);
+      continue;
     }
+
+    cl_uint num_groups = directory[length][HT_DIR_NUM_GROUPS];
+    cl_uchar *tags = &hash_table_ptr[directory[length][HT_DIR_TAGS]];
+    cl_uint *indexes = reinterpret_cast<cl_uint *>(tags
+        + num_groups * HT_GROUP_SIZE);
+    cl_uchar *entries = &hash_table_ptr[directory[length][HT_DIR_ENTRIES]];
+    cl_uint index = 0;
+
+    forEachWord(length, [&] (const Word & word)
+    {
+      uint32_t hash = word.hash;
+
+      cl_uchar *entry = &entries[index * (length + HT_EXTRA_BYTES)];
+      entry[HT_LENGTH_OFFSET] = length;
+      entry[HT_FLAG_OFFSET] = HT_NOTFOUND;
+      memcpy(&entry[HT_PAYLOAD_OFFSET], word.str, length);
+
+      // Find first empty slot by linear probing of groups
+      unsigned slot = ((hash >> HT_TAG_BITS) & (num_groups - 1))
+          * HT_GROUP_SIZE;
+      while (tags[slot] != HT_EMPTY)
+        slot = (slot + 1) % (num_groups * HT_GROUP_SIZE);
+
+      tags[slot] = HT_OCCUPIED | (hash & HT_TAG_MASK);
+      indexes[slot] = index;
+
+      addToBloom(hash_table_ptr, hash);
+
+      index++;
+    });
   }
 
-  return hash_table_size;
+  // Details are printed for the whole dictionary
+  _shard = 0;
+  _num_shards = 1;
+
+  return offset;
 }
 
 void HashTable::Details()
 {
 #ifndef NDEBUG
-  cout << "Load factor: " << _hash_table.load_factor() << "\n";
-  cout << "Longest bucket size: " << longestBucketSize() << "\n";
-  cout << "Total buckets: " << _hash_table.bucket_count() << "\n";
-  cout << "Maximal length of word in dictionary: " << _max_length << "\n";
+  for (unsigned length = 0; length <= MAX_PASS_LENGTH; length++)
+  {
+    if (numWords(length) != 0)
+      cout << "Words of length " << length << ": " << numWords(length)
+           << "\n";
+  }
+  cout << "Skipped words: " << _num_skipped << "\n";
+  if (_perfect_hash)
+    cout << "Perfect sub-tables: " << _num_perfect << "\n";
+  cout << "Hash table size: " << _hash_table_size << "\n";
 #endif
+
+  if (_perfect_hash
+      && find(_perfect_fallback.begin(), _perfect_fallback.end(), true)
+          != _perfect_fallback.end())
+  {
+    cerr << "Perfect hash could not be built, probing is used for lengths:";
+    for (unsigned length = 0; length <= MAX_PASS_LENGTH; length++)
+    {
+      if (_perfect_fallback[length])
+        cerr << " " << length;
+    }
+    cerr << endl;
+  }
+}
+
+cl_uchar * HashTable::Allocate(std::size_t size)
+{
+  void *ptr;
+#ifndef _WIN32
+  if (posix_memalign(&ptr, HT_PAGE_SIZE, size) != 0)
+    ptr = nullptr;
+#else
+  ptr = _aligned_malloc(size, HT_PAGE_SIZE);
+#endif
+
+  if (ptr == nullptr)
+    throw bad_alloc { };
+
+  return static_cast<cl_uchar *>(ptr);
 }
 
-unsigned HashTable::longestBucketSize()
+void HashTable::Free(cl_uchar *hash_table)
 {
-  unsigned num_buckets = _hash_table.bucket_count();
+#ifndef _WIN32
+  free(hash_table);
+#else
+  _aligned_free(hash_table);
+#endif
+}
+
+uint32_t HashTable::Hash(const cl_uchar *str, unsigned length)
+{
+  return hash_word(str, length);
+}
+
+uint64_t HashTable::MatchTag(uint64_t group, uint8_t tag)
+{
+  // Matching bytes are zero after XOR, find them without carries between bytes
+  const uint64_t low_bits = 0x7F7F7F7F7F7F7F7Full;
+  uint64_t x = group ^ (0x0101010101010101ull * tag);
+
+  return ~(((x & low_bits) + low_bits) | x) & ~low_bits;
+}
+
+cl_uchar * HashTable::Find(cl_uchar *hash_table, const cl_uchar *str,
+                           unsigned length)
+{
+  return Find(hash_table, str, length, Hash(str, length));
+}
+
+cl_uchar * HashTable::Find(cl_uchar *hash_table, const cl_uchar *str,
+                           unsigned length, uint32_t hash)
+{
+  if (length > MAX_PASS_LENGTH)
+    return nullptr;
+
+  const cl_uint *directory = reinterpret_cast<const cl_uint *>(hash_table)
+      + length * HT_DIR_FIELDS;
+  cl_uint num_groups = directory[HT_DIR_NUM_GROUPS];
+
+  if (num_groups == 0)
+    return nullptr;
+
+  if (ShardOf(hash, NumShards(hash_table)) != reinterpret_cast<const cl_uint *>(
+      hash_table)[HT_SHARD_RECORD * HT_DIR_FIELDS + HT_SHARD_INDEX])
+    return nullptr;
+
+  if (!BloomContains(hash_table, hash))
+    return nullptr;
+
+  if (directory[HT_DIR_LAYOUT] == HT_LAYOUT_PERFECT)
+  {
+    // The only slot where the word can be, fingerprint rejects other words
+    cl_uint num_buckets = directory[HT_DIR_NUM_BUCKETS];
+    const cl_uint *displacement_table = reinterpret_cast<const cl_uint *>(
+        &hash_table[directory[HT_DIR_DISPLACEMENTS]]);
+    const uint16_t *fingerprints = reinterpret_cast<const uint16_t *>(
+        displacement_table + num_buckets);
+
+    uint32_t hash2 = secondHash(str, length, directory[HT_DIR_SEED]);
+
+    unsigned slot = hash_perfect_slot(
+        hash, hash2, displacement_table[hash_range(hash, num_buckets)],
+        directory[HT_DIR_NUM_ENTRIES]);
+    if (fingerprints[slot] != (uint16_t) (hash ^ hash2))
+      return nullptr;
+
+    cl_uchar *entry = &hash_table[directory[HT_DIR_ENTRIES]
+        + slot * (length + HT_EXTRA_BYTES)];
+    if (memcmp(&entry[HT_PAYLOAD_OFFSET], str, length) == 0)
+      return entry;
+
+    return nullptr;
+  }
 
-  int longest_bucket = -1;
-  unsigned longest_bucket_size = 0;
+  uint8_t tag = HT_OCCUPIED | (hash & HT_TAG_MASK);
+  const cl_uchar *tags = &hash_table[directory[HT_DIR_TAGS]];
+  const cl_uint *indexes = reinterpret_cast<const cl_uint *>(tags
+      + num_groups * HT_GROUP_SIZE);
+  cl_uchar *entries = &hash_table[directory[HT_DIR_ENTRIES]];
+  uint64_t group;
 
-  unsigned bucket_size;
-  for (unsigned i = 0; i < num_buckets; i++)
+  for (unsigned probe = 0, group_index = hash >> HT_TAG_BITS;
+       probe < num_groups; probe++, group_index++)
   {
-    bucket_size = _hash_table.bucket_size(i);
-    if (bucket_size > longest_bucket_size)
+    group_index &= num_groups - 1;
+    memcpy(&group, &tags[group_index * HT_GROUP_SIZE], sizeof(group));
+
+    for (uint64_t matches = MatchTag(group, tag); matches != 0;
+         matches &= matches - 1)
+    {
+      unsigned slot = group_index * HT_GROUP_SIZE;
+      for (uint64_t bit = matches & -matches; bit > 0x80; bit >>= 8)
+        slot++;
+
+      cl_uchar *entry = &entries[indexes[slot] * (length + HT_EXTRA_BYTES)];
+      if (memcmp(&entry[HT_PAYLOAD_OFFSET], str, length) == 0)
+        return entry;
+    }
+
+    // Word would be in this group if there is an empty slot
+    if (~group & 0x8080808080808080ull)
+      return nullptr;
+  }
+
+  return nullptr;
+}
+
+std::size_t HashTable::NumEntries(const cl_uchar *hash_table)
+{
+  const cl_uint *directory = reinterpret_cast<const cl_uint *>(hash_table);
+  size_t num_entries = 0;
+
+  for (unsigned length = 0; length <= MAX_PASS_LENGTH; length++)
+    num_entries += directory[length * HT_DIR_FIELDS + HT_DIR_NUM_ENTRIES];
+
+  return num_entries;
+}
+
+std::size_t HashTable::Size(const cl_uchar *hash_table)
+{
+  return reinterpret_cast<const cl_uint *>(hash_table)[
+      HT_SHARD_RECORD * HT_DIR_FIELDS + HT_SHARD_SIZE];
+}
+
+unsigned HashTable::NumShards(const cl_uchar *hash_table)
+{
+  return reinterpret_cast<const cl_uint *>(hash_table)[
+      HT_SHARD_RECORD * HT_DIR_FIELDS + HT_SHARD_COUNT];
+}
+
+unsigned HashTable::ShardOf(uint32_t hash, unsigned num_shards)
+{
+  return hash_shard(hash, num_shards);
+}
+
+bool HashTable::BloomContains(const cl_uchar *hash_table, uint32_t hash)
+{
+  const cl_uint *record = bloomRecord(hash_table);
+  if (record[HT_BLOOM_NUM_BLOCKS] == 0)
+    return true;
+
+  uint64_t block;
+  memcpy(&block, &hash_table[record[HT_BLOOM_OFFSET] + sizeof(block)
+      * (hash & (record[HT_BLOOM_NUM_BLOCKS] - 1))], sizeof(block));
+
+  uint32_t state = hash;
+  for (unsigned i = 0; i < record[HT_BLOOM_NUM_HASHES]; i++)
+  {
+    if (!(block & (1ull << hash_bloom_bit(&state))))
+      return false;
+  }
+
+  return true;
+}
+
+bool HashTable::ShrinkBloom(cl_uchar *hash_table, std::size_t max_size)
+{
+  cl_uint *record = const_cast<cl_uint *>(bloomRecord(hash_table));
+  uint64_t *blocks = reinterpret_cast<uint64_t *>(&hash_table[
+      record[HT_BLOOM_OFFSET]]);
+  bool shrunk = false;
+
+  while (record[HT_BLOOM_NUM_BLOCKS] * sizeof(uint64_t) > max_size
+      && record[HT_BLOOM_NUM_BLOCKS] > 1)
+  {
+    unsigned half = record[HT_BLOOM_NUM_BLOCKS] / 2;
+
+    for (unsigned i = 0; i < half; i++)
+      blocks[i] |= blocks[i + half];
+
+    record[HT_BLOOM_NUM_BLOCKS] = half;
+    shrunk = true;
+  }
+
+  return shrunk;
+}
+
+std::size_t HashTable::BloomSize(const cl_uchar *hash_table)
+{
+  return bloomRecord(hash_table)[HT_BLOOM_NUM_BLOCKS] * sizeof(uint64_t);
+}
+
+double HashTable::BloomFalsePositiveRate(const cl_uchar *hash_table)
+{
+  const cl_uint *record = bloomRecord(hash_table);
+  const uint64_t *blocks = reinterpret_cast<const uint64_t *>(&hash_table[
+      record[HT_BLOOM_OFFSET]]);
+  unsigned num_blocks = record[HT_BLOOM_NUM_BLOCKS];
+  double rate = 0;
+
+  if (num_blocks == 0)
+    return 1;
+
+  // Word passes if all its bits are set in its block
+  for (unsigned i = 0; i < num_blocks; i++)
+  {
+    unsigned bits_set = 0;
+    for (uint64_t block = blocks[i]; block != 0; block &= block - 1)
+      bits_set++;
+
+    rate += pow(bits_set / 64.0, record[HT_BLOOM_NUM_HASHES]);
+  }
+
+  return rate / num_blocks;
+}
+
+void HashTable::addToBloom(cl_uchar *hash_table, uint32_t hash)
+{
+  const cl_uint *record = bloomRecord(hash_table);
+  if (record[HT_BLOOM_NUM_BLOCKS] == 0)
+    return;
+
+  uint64_t *block = reinterpret_cast<uint64_t *>(&hash_table[
+      record[HT_BLOOM_OFFSET]]) + (hash & (record[HT_BLOOM_NUM_BLOCKS] - 1));
+
+  uint32_t state = hash;
+  for (unsigned i = 0; i < record[HT_BLOOM_NUM_HASHES]; i++)
+  {
+    *block |= 1ull << hash_bloom_bit(&state);
+  }
+}
+
+bool HashTable::buildPerfect(unsigned length,
+                             std::vector<uint32_t> & displacements,
+                             std::vector<uint32_t> & slots, uint32_t & seed)
+{
+  uint32_t num_words = numWords(length);
+  uint32_t num_buckets = (num_words + HT_PERFECT_BUCKET_SIZE - 1)
+      / HT_PERFECT_BUCKET_SIZE;
+  vector<uint32_t> hashes;
+  vector<uint32_t> hashes2;
+  vector<uint64_t> keys;
+  vector<vector<uint32_t>> buckets(num_buckets);
+
+  forEachWord(length, [&] (const Word & word)
+  {
+    buckets[hash_range(word.hash, num_buckets)].push_back(hashes.size());
+    hashes.push_back(word.hash);
+  });
+
+  // Words with the same hash can't get different slots, the second hash
+  // is used only then
+  seed = 0;
+  hashes2.assign(num_words, 0);
+  keys.assign(hashes.begin(), hashes.end());
+  sort(keys.begin(), keys.end());
+
+  if (adjacent_find(keys.begin(), keys.end()) != keys.end())
+  {
+    seed = HT_PERFECT_SEED;
+    keys.clear();
+
+    unsigned i = 0;
+    forEachWord(length, [&] (const Word & word)
     {
-      longest_bucket = i;
-      longest_bucket_size = bucket_size;
+      hashes2[i] = secondHash(word.str, length, seed);
+      keys.push_back((uint64_t) hashes[i] << 32 | hashes2[i]);
+      i++;
+    });
+
+    sort(keys.begin(), keys.end());
+    if (adjacent_find(keys.begin(), keys.end()) != keys.end())
+      return false;
+  }
+
+  // Place the largest buckets first while there are many free slots
+  vector<uint32_t> order(num_buckets);
+  for (uint32_t i = 0; i < num_buckets; i++)
+    order[i] = i;
+  stable_sort(order.begin(), order.end(), [&buckets] (uint32_t a, uint32_t b)
+  {
+    return buckets[a].size() > buckets[b].size();
+  });
+
+  vector<bool> taken(num_words, false);
+  vector<uint32_t> bucket_slots;
+
+  displacements.assign(num_buckets, 0);
+  slots.assign(num_words, 0);
+
+  for (uint32_t bucket : order)
+  {
+    if (buckets[bucket].empty())
+      break;
+
+    uint32_t displacement = 0;
+    while (true)
+    {
+      bucket_slots.clear();
+
+      for (uint32_t word : buckets[bucket])
+      {
+        uint32_t slot = hash_perfect_slot(hashes[word], hashes2[word],
+                                          displacement, num_words);
+        if (taken[slot] || find(bucket_slots.begin(), bucket_slots.end(), slot)
+            != bucket_slots.end())
+          break;
+
+        bucket_slots.push_back(slot);
+      }
+
+      if (bucket_slots.size() == buckets[bucket].size())
+        break;
+
+      if (++displacement > _max_displacement)
+        return false;
+    }
+
+    displacements[bucket] = displacement;
+    for (unsigned i = 0; i < bucket_slots.size(); i++)
+    {
+      taken[bucket_slots[i]] = true;
+      slots[buckets[bucket][i]] = bucket_slots[i];
     }
   }
 
-  if (longest_bucket_size == -1)
-    throw runtime_error { "Hash table is probably empty" };
+  return true;
+}
+
+void HashTable::serializePerfect(cl_uchar *hash_table, unsigned length,
+                                 const std::vector<uint32_t> & displacements,
+                                 const std::vector<uint32_t> & slots)
+{
+  const cl_uint *directory = reinterpret_cast<const cl_uint *>(hash_table)
+      + length * HT_DIR_FIELDS;
+  cl_uint *displacement_table = reinterpret_cast<cl_uint *>(
+      &hash_table[directory[HT_DIR_DISPLACEMENTS]]);
+  uint16_t *fingerprints = reinterpret_cast<uint16_t *>(
+      displacement_table + displacements.size());
+  cl_uchar *entries = &hash_table[directory[HT_DIR_ENTRIES]];
+  unsigned index = 0;
+
+  memcpy(displacement_table, displacements.data(),
+         displacements.size() * sizeof(cl_uint));
 
-  return (longest_bucket_size);
+  // Words are visited in the same order as by buildPerfect
+  forEachWord(length, [&] (const Word & word)
+  {
+    uint32_t hash2 = secondHash(word.str, length, directory[HT_DIR_SEED]);
+    uint32_t slot = slots[index++];
+
+    cl_uchar *entry = &entries[slot * (length + HT_EXTRA_BYTES)];
+    entry[HT_LENGTH_OFFSET] = length;
+    entry[HT_FLAG_OFFSET] = HT_NOTFOUND;
+    memcpy(&entry[HT_PAYLOAD_OFFSET], word.str, length);
+
+    fingerprints[slot] = word.hash ^ hash2;
+
+    addToBloom(hash_table, word.hash);
+  });
+}
+
+uint32_t HashTable::secondHash(const cl_uchar *str, unsigned length,
+                               uint32_t seed)
+{
+  return (seed == 0) ? 0 : hash_word_seed(str, length, seed);
+}
+
+const cl_uint * HashTable::bloomRecord(const cl_uchar *hash_table)
+{
+  return reinterpret_cast<const cl_uint *>(hash_table)
+      + HT_BLOOM_RECORD * HT_DIR_FIELDS;
+}
+
+std::size_t HashTable::align(std::size_t offset)
+{
+  // Tags are read by 64-bit words
+  return (offset + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
 }
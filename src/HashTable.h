@@ -29,26 +29,118 @@
 #include <cstdint>
 
 #include <string>
+#include <vector>
 #include <unordered_set>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <cstring>
 
 #include <CL/cl.hpp>
 
+#include "Constants.h"
+
 #define HT_EXTRA_BYTES 2
 #define HT_LENGTH_OFFSET 0
 #define HT_FLAG_OFFSET 1
 #define HT_PAYLOAD_OFFSET 2
 #define HT_FOUND 1
 #define HT_NOTFOUND 0
+#define HT_MAX_RANK 254
+
+// Open addressing with groups of slots, every slot has tag byte
+#define HT_GROUP_SIZE 8
+#define HT_TAG_BITS 7
+#define HT_TAG_MASK 0x7F
+#define HT_OCCUPIED 0x80
+#define HT_EMPTY 0
+
+// Fields of sub-table in directory, offsets are in bytes from table start
+#define HT_DIR_TAGS 0
+#define HT_DIR_NUM_GROUPS 1
+#define HT_DIR_ENTRIES 2
+#define HT_DIR_NUM_ENTRIES 3
+#define HT_DIR_LAYOUT 4
+#define HT_DIR_SEED 5
+#define HT_DIR_FLAGS 6
+#define HT_DIR_FIELDS 7
+
+// Perfect sub-tables have displacements in place of tags and groups
+#define HT_DIR_DISPLACEMENTS 0
+#define HT_DIR_NUM_BUCKETS 1
+
+#define HT_LAYOUT_TAGGED 0
+#define HT_LAYOUT_PERFECT 1
+// Average number of words per bucket of perfect sub-table
+#define HT_PERFECT_BUCKET_SIZE 4
+// Seed of second hash for perfect sub-tables with colliding hashes
+#define HT_PERFECT_SEED 0x5bd1e995U
+
+// Words of every length are split into 2^HT_STRIPE_BITS stripes by hash
+#define HT_STRIPE_BITS 6
 
+// Record of Bloom filter in directory, it follows records of sub-tables
+#define HT_BLOOM_RECORD (MAX_PASS_LENGTH + 1)
+#define HT_BLOOM_OFFSET 0
+#define HT_BLOOM_NUM_BLOCKS 1
+#define HT_BLOOM_NUM_HASHES 2
+
+// Record of shard in directory, table holds only words of its shard and
+// tables of other shards follow it in index
+#define HT_SHARD_RECORD (MAX_PASS_LENGTH + 2)
+#define HT_SHARD_INDEX 0
+#define HT_SHARD_COUNT 1
+#define HT_SHARD_SIZE 2
+#define HT_DIR_RECORDS (MAX_PASS_LENGTH + 3)
+
+// Serialized tables start at page boundary and their size is a multiple of
+// page, also in index, so CPU devices can use them without any copy
+#define HT_PAGE_SIZE 4096
+
+/**
+ * Dictionary for lookups of generated passwords. Words are split into
+ * sub-tables by their length, serialized table starts with directory
+ * of HT_DIR_FIELDS values for every length up to MAX_PASS_LENGTH and for
+ * optional blocked Bloom filter of all words (64-bit blocks, a word sets
+ * bits in a single block). Every sub-table consists of three parts:
+ *  - tags: one byte per slot, empty slot has 0, occupied one has HT_OCCUPIED
+ *    and low bits of word's hash, slots are grouped by HT_GROUP_SIZE
+ *  - indexes: 32-bit index of word's entry for every slot
+ *  - entries: length, flag and word, entry size is length + HT_EXTRA_BYTES
+ *
+ * Kernels don't write into the table, they set flags in separate array with
+ * a byte for every entry. Flags of sub-table start at HT_DIR_FLAGS.
+ *
+ * Sub-tables can be built with minimal perfect hash (CHD-like hash and
+ * displace) instead, then they consist of:
+ *  - displacements: 32-bit value for every bucket of HT_PERFECT_BUCKET_SIZE
+ *    words on average, bucket is chosen by high bits of word's hash
+ *  - fingerprints: low 16 bits of hash for every slot
+ *  - entries: as above, but in order of slots, so there is no empty slot
+ * If two words of sub-table have the same hash, slots are computed also
+ * from second hash with seed stored in directory (larger dictionaries).
+ *
+ * Dictionary can be split by hash_shard() into several tables, which are
+ * serialized separately, so every device holds only a part of it.
+ */
 class HashTable
 {
 public:
   /**
    * Construct hash table
-   * @param num_words Number of words in dictionary (only prevents rehashing)
-   * @param max_load_factor Average number of entries per bucket (row)
+   * @param max_load_factor Maximal ratio of occupied slots (at most 7/8)
+   * @param min_length Shorter words are skipped
+   * @param max_length Longer words are skipped
+   * @param bloom_bits Bits of Bloom filter per word (0 disables filter)
+   * @param perfect_hash Build sub-tables with minimal perfect hash, load
+   *        factor is ignored then except for sub-tables where no perfect
+   *        hash was found, which fall back to probing
    */
-  HashTable(unsigned num_words, float max_load_factor = 1.0);
+  HashTable(float max_load_factor = 0.875,
+            unsigned min_length = MIN_PASS_LENGTH,
+            unsigned max_length = MAX_PASS_LENGTH, unsigned bloom_bits = 0,
+            bool perfect_hash = false);
   ~HashTable();
 
   /**
@@ -58,52 +150,206 @@ public:
   void Insert(std::string & value);
 
   /**
-   * Get length of single entry in bytes (maxLength + 1)
+   * Insert word unless it's already in hash table, bytes of the word are
+   * copied. It can be called from several threads at once.
+   * @param str word (not terminated)
+   * @param length length of word
    */
-  unsigned GetEntryLength();
+  void Insert(const cl_uchar *str, unsigned length);
 
   /**
-   * Get number of buckets (rows in hash table)
+   * Serialize C++ hash table into flat array for GPU
+   * @param hash_table allocated by Allocate(), it has to be released by
+   *        Free()
+   * @param shard only words of this shard are serialized
+   * @param num_shards number of shards of the dictionary
+   * @return size of serialized table in bytes
    */
-  unsigned GetBucketCount();
+  std::size_t Serialize(cl_uchar **hash_table, unsigned shard = 0,
+                        unsigned num_shards = 1);
 
   /**
-   * Serialize C++ hash table into flat array for GPU
-   * @param hash_table
-   * @param num_rows
-   * @param num_entries
-   * @param entry_size
-   * @param row_size
+   * Print statistics, lengths which fell back from perfect hash to probing
+   * are always reported
    */
-  unsigned Serialize(cl_uchar **hash_table, cl_uint & num_rows,
-                     cl_uint & num_entries, cl_uint & entry_size,
-                     cl_uint & row_size);
-
   void Details();
 
+  /**
+   * Allocate memory for serialized table aligned to HT_PAGE_SIZE
+   */
+  static cl_uchar * Allocate(std::size_t size);
+  static void Free(cl_uchar *hash_table);
+
+  /**
+   * Hash of the word, same as hash_word() in kernels
+   */
+  static uint32_t Hash(const cl_uchar *str, unsigned length);
+
+  /**
+   * Find slots in group whose tag equals to given one
+   * @param group tags of the group
+   * @return the highest bit of every matching byte is set
+   */
+  static uint64_t MatchTag(uint64_t group, uint8_t tag);
+
+  /**
+   * Find entry in serialized table
+   * @return pointer to entry or nullptr if the word isn't in table
+   */
+  static cl_uchar * Find(cl_uchar *hash_table, const cl_uchar *str,
+                         unsigned length);
+
+  /**
+   * Find entry in serialized table by already computed hash of the word
+   * @param hash hash of the word as returned by Hash
+   */
+  static cl_uchar * Find(cl_uchar *hash_table, const cl_uchar *str,
+                         unsigned length, uint32_t hash);
+
+  /**
+   * Return number of entries in all sub-tables of serialized table
+   */
+  static std::size_t NumEntries(const cl_uchar *hash_table);
+
+  /**
+   * Return size of serialized table in bytes
+   */
+  static std::size_t Size(const cl_uchar *hash_table);
+
+  /**
+   * Return number of shards of dictionary which the table belongs to
+   */
+  static unsigned NumShards(const cl_uchar *hash_table);
+
+  /**
+   * Return shard which owns the word
+   * @param hash hash of the word
+   */
+  static unsigned ShardOf(uint32_t hash, unsigned num_shards);
+
+  /**
+   * Test if the word can be in serialized table according to Bloom filter
+   * @param hash hash of the word
+   */
+  static bool BloomContains(const cl_uchar *hash_table, uint32_t hash);
+
+  /**
+   * Fold Bloom filter in serialized table to half until it fits given size,
+   * it stays valid because block index is taken from low bits of hash
+   * @return FALSE if the filter wasn't changed
+   */
+  static bool ShrinkBloom(cl_uchar *hash_table, std::size_t max_size);
+
+  /**
+   * Return size of Bloom filter in bytes
+   */
+  static std::size_t BloomSize(const cl_uchar *hash_table);
+
+  /**
+   * Estimate false-positive rate of Bloom filter from its occupancy
+   */
+  static double BloomFalsePositiveRate(const cl_uchar *hash_table);
 
 private:
+  /**
+   * Stored word with its hash, length is given by the stripe
+   */
+  struct Word
+  {
+    const cl_uchar *str;
+    uint32_t hash;
+  };
+
   class hash_func
   {
   public:
-    size_t operator()(const std::string &value) const
+    size_t operator()(const Word &word) const
+    {
+      return word.hash;
+    }
+  };
+
+  class equal_func
+  {
+  public:
+    equal_func(unsigned length) : _length { length }
     {
-      uint32_t hash = 5381;
+    }
 
-      for (auto c : value)
-      {
-        hash = ((hash << 5) + hash) + c;
-      }
-      return (hash);
+    bool operator()(const Word &w1, const Word &w2) const
+    {
+      return w1.hash == w2.hash && memcmp(w1.str, w2.str, _length) == 0;
     }
+
+  private:
+    unsigned _length;
   };
 
-  unsigned longestBucketSize();
+  /**
+   * Words of one length with the same high bits of hash. Bytes of words
+   * are kept in large blocks instead of allocation per word.
+   */
+  struct Stripe
+  {
+    Stripe(unsigned length);
+    const cl_uchar * store(const cl_uchar *str, unsigned length);
 
-  std::unordered_set<std::string, hash_func> _hash_table;
+    std::mutex mutex;
+    std::unordered_set<Word, hash_func, equal_func> words;
+    std::vector<std::unique_ptr<cl_uchar[]>> blocks;
+    std::size_t block_used;
+  };
 
-  unsigned _max_length = 0;
+  /**
+   * Stripes of every length, stripes of a length are consecutive
+   */
+  std::vector<std::unique_ptr<Stripe>> _stripes;
 
+  unsigned _min_length;
+  unsigned _max_length;
+  std::atomic<unsigned> _num_skipped;
+  unsigned _bloom_bits;
+  const unsigned _max_bloom_hashes = 8;
+  bool _perfect_hash;
+  unsigned _num_perfect = 0;
+  /**
+   * Lengths whose perfect sub-table could not be built in some shard and
+   * were laid out for probing instead
+   */
+  std::vector<bool> _perfect_fallback =
+      std::vector<bool>(MAX_PASS_LENGTH + 1, false);
+  /**
+   * Tried displacements of a bucket before giving up
+   */
+  const uint32_t _max_displacement = 1 << 24;
+  float _max_load_factor;
+  /**
+   * Shard which is being serialized, other words are skipped
+   */
+  unsigned _shard = 0;
+  unsigned _num_shards = 1;
+  /**
+   * Size of all serialized shards
+   */
+  std::size_t _hash_table_size = 0;
+
+  static std::size_t align(std::size_t offset);
+  static const std::size_t _stripe_block_size = 1 << 20;
+  std::size_t numWords(unsigned length);
+  /**
+   * Call function for every word of given length in serialized shard, order
+   * of words is the same in every call
+   */
+  void forEachWord(unsigned length, const std::function<void(const Word &)> & fn);
+  static const cl_uint * bloomRecord(const cl_uchar *hash_table);
+  static void addToBloom(cl_uchar *hash_table, uint32_t hash);
+  bool buildPerfect(unsigned length, std::vector<uint32_t> & displacements,
+                    std::vector<uint32_t> & slots, uint32_t & seed);
+  void serializePerfect(cl_uchar *hash_table, unsigned length,
+                        const std::vector<uint32_t> & displacements,
+                        const std::vector<uint32_t> & slots);
+  static uint32_t secondHash(const cl_uchar *str, unsigned length,
+                             uint32_t seed);
 };
 
 #endif /* HASHTABLE_H_ */
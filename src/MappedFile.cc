@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2016 Peter Gazdik
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#include <MappedFile.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <fstream>
+#include <stdexcept>
+
+using namespace std;
+
+MappedFile::MappedFile(const std::string & file_name, bool copy_on_write)
+{
+#ifndef _WIN32
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw runtime_error { "Unable to open file: " + file_name };
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) < 0)
+  {
+    close(fd);
+    throw runtime_error { "Unable to read file: " + file_name };
+  }
+
+  _size = file_stat.st_size;
+
+  if (_size > 0)
+  {
+    int protection = copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *data = mmap(nullptr, _size, protection, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+      throw runtime_error { "Unable to map file: " + file_name };
+
+    _data = static_cast<uint8_t *>(data);
+  }
+  else
+  {
+    close(fd);
+  }
+#else
+  ifstream input { file_name, ifstream::in | ifstream::binary };
+  if (!input.is_open())
+    throw runtime_error { "Unable to open file: " + file_name };
+
+  _buffer.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+  _data = _buffer.data();
+  _size = _buffer.size();
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifndef _WIN32
+  if (_data != nullptr)
+    munmap(_data, _size);
+#endif
+}
+
+const uint8_t * MappedFile::Data() const
+{
+  return _data;
+}
+
+uint8_t * MappedFile::MutableData()
+{
+  return _data;
+}
+
+std::size_t MappedFile::Size() const
+{
+  return _size;
+}
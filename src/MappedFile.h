@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2016 Peter Gazdik
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef MAPPEDFILE_H_
+#define MAPPEDFILE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Read-only file mapped into memory. On platforms without mmap the file
+ * is read into a buffer instead.
+ */
+class MappedFile
+{
+public:
+  /**
+   * @param copy_on_write allow changes of mapped memory, they aren't written
+   *        back to the file
+   */
+  MappedFile(const std::string & file_name, bool copy_on_write = false);
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile & operator=(const MappedFile &) = delete;
+
+  /**
+   * Return pointer to the beginning of the file
+   */
+  const uint8_t * Data() const;
+
+  /**
+   * Return writable pointer to the beginning of the file, the file must be
+   * mapped with copy_on_write
+   */
+  uint8_t * MutableData();
+
+  /**
+   * Return size of the file in bytes
+   */
+  std::size_t Size() const;
+
+private:
+  uint8_t *_data = nullptr;
+  std::size_t _size = 0;
+  /**
+   * Content of the file if it isn't mapped
+   */
+  std::vector<uint8_t> _buffer;
+};
+
+#endif /* MAPPEDFILE_H_ */
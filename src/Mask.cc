@@ -78,6 +78,11 @@ bool MaskElement::Satisfy(uint8_t character) const
   return _charset_flags.test(character);
 }
 
+bool MaskElement::operator==(const MaskElement & other) const
+{
+  return _charset_flags == other._charset_flags;
+}
+
 Mask::Mask(const std::string& mask)
 {
   for (unsigned i = 0; i < mask.size(); i++)
@@ -66,6 +66,11 @@ public:
    * Returns number of characters that satisfy mask
    */
   std::size_t Count() const;
+
+  /**
+   * Test if both masks are satisfied by the same characters
+   */
+  bool operator==(const MaskElement & other) const;
 private:
   std::bitset<CHARSET_SIZE> _charset_flags;
 };
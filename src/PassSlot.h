@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2016 Peter Gazdik
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Slots of generated passwords in batch buffer shared by host code and
+ * kernels. Record of password (PASS_EXTRA_BYTES and the password) is padded
+ * to whole vectors of PASS_SLOT_ALIGN bytes, all passwords of a batch have
+ * the same length and so the same slot size.
+ */
+
+#ifndef PASSSLOT_H_
+#define PASSSLOT_H_
+
+#define PASS_SLOT_ALIGN 16
+#define PASS_SLOT_SIZE(length) \
+  (((length) + PASS_EXTRA_BYTES + PASS_SLOT_ALIGN - 1) / PASS_SLOT_ALIGN \
+      * PASS_SLOT_ALIGN)
+
+#ifdef __OPENCL_VERSION__
+
+/**
+ * Copy record of password from private memory into its slot, record must
+ * have PASS_SLOT_SIZE(MAX_PASS_LENGTH) bytes
+ */
+void store_slot (const uchar *record, uint slot_size, __global uchar *slot)
+{
+  for (uint v = 0; v < slot_size / PASS_SLOT_ALIGN; v++)
+    vstore16(vload16(v, record), v, slot);
+}
+
+/**
+ * Copy record of password from its slot into private memory
+ */
+void load_slot (__global const uchar *slot, uint slot_size, uchar *record)
+{
+  for (uint v = 0; v < slot_size / PASS_SLOT_ALIGN; v++)
+    vstore16(vload16(v, slot), v, record);
+}
+
+#endif
+
+#endif /* PASSSLOT_H_ */
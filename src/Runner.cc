@@ -30,33 +30,80 @@
 #include <iostream>
 #include <stdexcept>
 #include <sstream>
+#include <algorithm>
 
 #include "Runner.h"
+#include "PassSlot.h"
 
 using namespace std;
 
 Runner::Runner(Options & options) :
-    _gws { options.gws }, _verbose { options.verbose }
+    _gws { options.gws }, _verbose { options.verbose },
+    _analytic { options.analytic },
+    _fused { options.fused || options.persistent },
+    _persistent { options.persistent },
+    _generic_kernels { options.generic_kernels },
+    _pipeline_depth { options.pipeline_depth }
 {
   parseOptions(options);
 
+  // Self-test needs only OpenCL devices
+  if (options.self_test)
+  {
+    _passgen = nullptr;
+    _cracker = nullptr;
+    createContext();
+    return;
+  }
+
   _passgen = new CLMarkovPassGen { options };
+
+  // Dictionary words of other lengths can't be cracked
+  options.min_length = _passgen->MinPasswordLength();
+  options.max_length = _passgen->MaxPasswordLength();
+  options.first_index = _passgen->FirstIndex();
   _cracker = new Cracker { options };
 
+  // Analytic evaluation doesn't need any OpenCL device
+  if (_analytic)
+    return;
+
+  if (_cpu_backend)
+  {
+    initHost();
+    return;
+  }
+
   createContext();
+
+  if (_fused)
+  {
+    initFused();
+    return;
+  }
+
   initGenerator();
   initCracker();
 }
 
 void Runner::Run()
 {
+  if (_analytic)
+  {
+    runAnalytic();
+    _cracker->PrintResults(_passgen->SweepThresholds());
+    return;
+  }
 
   vector<thread> threads;
-  unsigned num_threads = _device.size();
+  unsigned num_threads = _cpu_backend ? _num_threads : _device.size();
 
   for (unsigned i = 0; i < num_threads; i++)
   {
-    threads.push_back(thread { &Runner::runThread, this, i });
+    if (_cpu_backend)
+      threads.push_back(thread { &Runner::runHostThread, this, i });
+    else
+      threads.push_back(thread { &Runner::runThread, this, i });
   }
 
   // Wait for all threads to complete
@@ -65,7 +112,7 @@ void Runner::Run()
     i.join();
   }
 
-  _cracker->PrintResults();
+  _cracker->PrintResults(_passgen->SweepThresholds());
 }
 
 void Runner::createContext()
@@ -96,10 +143,17 @@ void Runner::createContext()
       (cl_context_properties) (platform_list[_selected_platform])(), 0 };
   _context = cl::Context { _device, context_properties };
 
-  // Create command queues
+  // Create command queues, batches in flight can overlap on devices
+  // with out-of-order execution, dependencies are kept by events
   for (unsigned i = 0; i < _device.size(); i++)
   {
-    cl::CommandQueue queue { _context, _device[i] };
+    cl_command_queue_properties properties = 0;
+    if (_pipeline_depth > 1
+        && (_device[i].getInfo<CL_DEVICE_QUEUE_PROPERTIES>()
+            & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE))
+      properties = CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+
+    cl::CommandQueue queue { _context, _device[i], properties };
     _command_queue.push_back(queue);
   }
 }
@@ -110,41 +164,69 @@ Runner::~Runner()
   delete _cracker;
 }
 
-void Runner::initGenerator()
+cl::Program Runner::buildProgram(const std::vector<std::string> & source_files,
+                                 const std::string & options)
 {
-  _passgen->SetGWS(_gws);
+  // Concatenate all source files into single program
+  string source;
+  for (auto & file_name : source_files)
+  {
+    ifstream source_file { file_name, ifstream::in };
+    if (!source_file.is_open())
+      throw invalid_argument { "Kernel code missing: " + file_name };
 
-  unsigned num_devices = _device.size();
+    source.append(istreambuf_iterator<char>(source_file),
+                  istreambuf_iterator<char>());
+    source.append("\n");
+  }
+
+  // Create and build program, shared headers are in directory with kernels
+  string build_options = "-Werror -cl-std=CL1.2 -I " + _kernel_directory
+      + options;
 
-  // Get kernel source for generator
-  ifstream source_file { _passgen->GetKernelSource(), ifstream::in };
-  if (!source_file.is_open())
-    throw invalid_argument { "Kernel code missing" };
-  string source { (istreambuf_iterator<char>(source_file)), istreambuf_iterator<
-      char>() };
-
-  // Create and build program
-  cl::Program program{ _context, source, true };
-  try {
-	  program.build("-Werror -cl-std=CL1.2");
+  cl::Program program { _context, source };
+  try
+  {
+    program.build(build_options.c_str());
   }
   catch (cl::Error &err)
   {
-	  cl::STRING_CLASS log;
-	  program.getBuildInfo(_device[0], CL_PROGRAM_BUILD_LOG, &log);
-	  cout << log << endl;
-	  exit(EXIT_FAILURE);
+    cl::STRING_CLASS log;
+    program.getBuildInfo(_device[0], CL_PROGRAM_BUILD_LOG, &log);
+    cout << log << endl;
+    exit(EXIT_FAILURE);
   }
 
-  // Create kernel's memory objects
-  _passwords_entry_size = _passgen->MaxPasswordLength() + PASS_EXTRA_BYTES;
-  size_t passwords_num_items = _passwords_entry_size * _gws;
-  size_t passwords_size = passwords_num_items * sizeof(cl_uchar);
+  return program;
+}
+
+void Runner::initGenerator()
+{
+  unsigned num_devices = _device.size();
+
+  cl::Program program = buildProgram({ _passgen->GetKernelSource() },
+                                     _passgen->GetBuildOptions(
+                                         _device, !_generic_kernels));
 
+  // Create kernel's memory objects
+  // Buffer has the size of GWS records of the longest passwords, every step
+  // fills it with as many slots of its length as fit (at least one item)
+  size_t item_size = _passgen->CandidatesPerItem()
+      * PASS_SLOT_SIZE(_passgen->MaxPasswordLength());
+  size_t passwords_size = _gws * _passgen->CandidatesPerItem()
+      * (_passgen->MaxPasswordLength() + PASS_EXTRA_BYTES);
+  passwords_size = max(passwords_size, item_size);
+  _passgen->SetBufferSize(passwords_size);
+
+  _passwords_buffer.resize(num_devices);
   for (unsigned i = 0; i < num_devices; i++)
   {
-    cl::Buffer passwords_buffer { _context, CL_MEM_READ_WRITE, passwords_size };
-    _passwords_buffer.push_back(passwords_buffer);
+    for (unsigned j = 0; j < _pipeline_depth; j++)
+    {
+      cl::Buffer passwords_buffer { _context, CL_MEM_READ_WRITE,
+                                    passwords_size };
+      _passwords_buffer[i].push_back(passwords_buffer);
+    }
   }
 
   // Create kernels
@@ -152,14 +234,15 @@ void Runner::initGenerator()
   {
     cl::Kernel kernel { program, _passgen->GetKernelName().c_str() };
 
-    // Set password buffer as first argument
-    kernel.setArg(0, _passwords_buffer[i]);
-    kernel.setArg(1, _passwords_entry_size);
+    // Set password buffer as first argument, slot size is set per step
+    kernel.setArg(0, _passwords_buffer[i][0]);
 
     _passgen_kernel.push_back(kernel);
   }
 
-  // Initialize generator's kernel
+  // Initialize generator's kernel, devices of every shard of dictionary
+  // generate the whole keyspace
+  _passgen->SetDeviceGroups(_cracker->NumShards());
   _passgen->InitKernel(_passgen_kernel, _command_queue, _context);
 }
 
@@ -167,74 +250,289 @@ void Runner::initCracker()
 {
   unsigned num_devices = _device.size();
 
-  // Get kernel source for generator
-  ifstream source_file { _cracker->GetKernelSource(), ifstream::in };
-  if (!source_file.is_open())
-    throw invalid_argument { "Cracker's kernel code missing" };
-  string source { (istreambuf_iterator<char>(source_file)), istreambuf_iterator<
-      char>() };
-
-  // Create and build program
-  cl::Program program { _context, source, true };
-  try
-  {
-    program.build("-Werror -cl-std=CL1.2");
-  }
-  catch (cl::Error &err)
-  {
-	  cl::STRING_CLASS log;
-	  program.getBuildInfo(_device[0], CL_PROGRAM_BUILD_LOG, &log);
-	  cout << log << endl;
-	  exit(EXIT_FAILURE);
-  }
+  // Sub-tables are described by directory in the table itself, so the
+  // kernel needs no options
+  cl::Program program = buildProgram({ _cracker->GetKernelSource() }, "");
 
   // Create kernels
   for (unsigned i = 0; i < num_devices; i++)
   {
     cl::Kernel kernel { program, _cracker->GetKernelName().c_str() };
 
-    // Set password buffer as first argument
-    kernel.setArg(0, _passwords_buffer[i]);
-    kernel.setArg(1, _passwords_entry_size);
+    // Set password buffer as first argument, slot size is set per step
+    kernel.setArg(0, _passwords_buffer[i][0]);
 
     _cracker_kernel.push_back(kernel);
   }
 
   // Initialize cracker's kernel
-  _cracker->InitKernel(_cracker_kernel, _command_queue, _context);
+  _cracker->InitKernel(_cracker_kernel, _command_queue, _context, 2,
+                       _pipeline_depth);
+}
+
+void Runner::initFused()
+{
+  _passgen->SetGWS(_gws);
+
+  unsigned num_devices = _device.size();
+
+  // Fused kernel uses functions from both generator and cracker
+  cl::Program program = buildProgram({ _passgen->GetKernelSource(),
+                                       _cracker->GetKernelSource(),
+                                       _fused_kernel_source },
+                                     _passgen->GetBuildOptions(
+                                         _device, !_generic_kernels));
+
+  string kernel_name = _persistent ? _persistent_kernel_name
+                                   : _fused_kernel_name;
+
+  // Create kernels
+  for (unsigned i = 0; i < num_devices; i++)
+  {
+    cl::Kernel kernel { program, kernel_name.c_str() };
+
+    // Fused kernel iterates over passwords even if there is only one
+    kernel.setArg(8, _passgen->CandidatesPerItem());
+
+    _fused_kernel.push_back(kernel);
+  }
+
+  // Persistent kernels occupy every compute unit by fixed number of groups
+  if (_persistent)
+  {
+    _chunk_counter_buffer.resize(num_devices);
+
+    for (unsigned i = 0; i < num_devices; i++)
+    {
+      size_t local_size = _fused_kernel[i].getWorkGroupInfo<
+          CL_KERNEL_WORK_GROUP_SIZE>(_device[i]);
+      cl_uint compute_units = _device[i].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+
+      _persistent_local_size.push_back(local_size);
+      _persistent_global_size.push_back(local_size * compute_units
+                                        * _persistent_groups_per_unit);
+
+      for (unsigned j = 0; j < _pipeline_depth; j++)
+      {
+        cl::Buffer counter_buffer { _context, CL_MEM_READ_WRITE,
+                                    sizeof(cl_uint) };
+        _chunk_counter_buffer[i].push_back(counter_buffer);
+      }
+    }
+  }
+
+  // Arguments of generator are followed by arguments of cracker
+  _passgen->SetDeviceGroups(_cracker->NumShards());
+  _passgen->InitKernel(_fused_kernel, _command_queue, _context, 0);
+  _cracker->InitKernel(_fused_kernel, _command_queue, _context, 9,
+                       _pipeline_depth);
+}
+
+void Runner::initHost()
+{
+  _passgen->SetGWS(_host_batch_size);
+  _passgen->InitHost(_num_threads);
 }
 
 void Runner::runThread(unsigned device_num)
 {
+  cl::CommandQueue & queue = _command_queue[device_num];
+  vector<vector<cl::Event>> batch_events(_pipeline_depth);
   vector<cl::Event> passgen_events;
-  vector<cl::Event> cracker_events;
   cl::Event event;
+  unsigned slot = 0;
 
-  bool flag = _passgen->NextKernelStep(device_num);
+  // Queue can execute out of order, wait for uploads of model and dictionary
+  queue.finish();
 
-  while (flag)
+  while (_persistent ? _passgen->NextKernelRange(device_num)
+                     : _passgen->NextKernelStep(device_num))
   {
+    // Buffer of the slot can be reused when its previous batch is done,
+    // so the host stays at most pipeline depth batches ahead. Log of the
+    // batch is read right after it, so draining doesn't wait for batches
+    // of other slots
+    if (!batch_events[slot].empty())
+      _cracker->DrainHitLog(device_num, slot);
+
     passgen_events.clear();
-    _command_queue[device_num].enqueueNDRangeKernel(_passgen_kernel[device_num],
-                                                 cl::NullRange,
-                                                 cl::NDRange(_gws),
-                                                 cl::NullRange, &cracker_events,
-                                                 &event);
-    passgen_events.push_back(event);
-
-    cracker_events.clear();
-    _command_queue[device_num].enqueueNDRangeKernel(_cracker_kernel[device_num],
-                                                 cl::NullRange,
-                                                 cl::NDRange(_gws),
-                                                 cl::NullRange, &passgen_events,
-                                                 &event);
-    cracker_events.push_back(event);
-
-    flag = _passgen->NextKernelStep(device_num);
-    cl::WaitForEvents(cracker_events);
+    _cracker->SetHitLog(device_num, slot, passgen_events);
+
+    if (_persistent)
+    {
+      // Seed counter of the batch, work-groups pull chunks from it
+      cl::Buffer & counter_buffer = _chunk_counter_buffer[device_num][slot];
+      _fused_kernel[device_num].setArg(15, counter_buffer);
+
+      queue.enqueueFillBuffer(counter_buffer, (cl_uint) 0, 0, sizeof(cl_uint),
+                              nullptr, &event);
+      passgen_events.push_back(event);
+
+      queue.enqueueNDRangeKernel(_fused_kernel[device_num], cl::NullRange,
+                                 cl::NDRange(_persistent_global_size[device_num]),
+                                 cl::NDRange(_persistent_local_size[device_num]),
+                                 &passgen_events, &event);
+    }
+    else if (_fused)
+    {
+      queue.enqueueNDRangeKernel(_fused_kernel[device_num], cl::NullRange,
+                                 cl::NDRange(_gws), cl::NullRange,
+                                 &passgen_events, &event);
+    }
+    else
+    {
+      _passgen_kernel[device_num].setArg(0, _passwords_buffer[device_num][slot]);
+      _cracker_kernel[device_num].setArg(0, _passwords_buffer[device_num][slot]);
+      _cracker_kernel[device_num].setArg(8, _passgen->StepStart(device_num));
+
+      // Slots and number of passwords are given by length of the step
+      cl_uint slot_size = PASS_SLOT_SIZE(_passgen->StepLength(device_num));
+      cl_ulong step_size = _passgen->StepSize(device_num);
+      _passgen_kernel[device_num].setArg(1, slot_size);
+      _cracker_kernel[device_num].setArg(1, slot_size);
+
+      queue.enqueueNDRangeKernel(_passgen_kernel[device_num], cl::NullRange,
+                                 cl::NDRange(step_size
+                                     / _passgen->CandidatesPerItem()),
+                                 cl::NullRange, nullptr, &event);
+      passgen_events.push_back(event);
+
+      queue.enqueueNDRangeKernel(_cracker_kernel[device_num], cl::NullRange,
+                                 cl::NDRange(step_size), cl::NullRange,
+                                 &passgen_events, &event);
+    }
+
+    batch_events[slot].assign(1, event);
+    _cracker->ReadHitLog(device_num, slot, batch_events[slot]);
+    queue.flush();
+
+    slot = (slot + 1) % _pipeline_depth;
+  }
+
+  queue.finish();
+
+  for (unsigned i = 0; i < _pipeline_depth; i++)
+  {
+    if (!batch_events[i].empty())
+      _cracker->DrainHitLog(device_num, i);
   }
 }
 
+void Runner::runAnalytic()
+{
+  _cracker->Evaluate([this] (const cl_uchar *password, unsigned length,
+                             unsigned & rank, cl_ulong & guess_number)
+  {
+    return _passgen->GuessNumber(password, length, guess_number, rank);
+  });
+}
+
+void Runner::runHostThread(unsigned thread_num)
+{
+  // Step of the generator spans batch size * passwords per item
+  unsigned entry_size = _passgen->MaxPasswordLength() + PASS_EXTRA_BYTES;
+  vector<cl_uchar> passwords(_host_batch_size * _passgen->CandidatesPerItem()
+                             * entry_size);
+  cl_ulong start, stop;
+  unsigned count;
+
+  while (_passgen->NextHostStep(thread_num, start, stop))
+  {
+    count = stop - start;
+
+    _passgen->Generate(start, count, passwords.data(), entry_size);
+    _cracker->Crack(passwords.data(), entry_size, count, start);
+  }
+}
+
+bool Runner::SelfTest()
+{
+  // Words of all lengths with characters above 0x7F, which are negative
+  // as signed char, and few ASCII ones
+  vector<string> words { "password", "123456", "p\xe1ssw\xf6rd", "\x80",
+                         "\xff\xfe", "\x7f\x80\x81" };
+  for (unsigned length = 1; length <= MAX_PASS_LENGTH; length++)
+  {
+    string word;
+    for (unsigned i = 0; i < length; i++)
+      word.push_back(0x80 + (length * 37 + i * 11) % 128);
+    words.push_back(word);
+  }
+
+  cl_uint entry_size = MAX_PASS_LENGTH + PASS_EXTRA_BYTES;
+  vector<cl_uchar> entries(words.size() * entry_size, 0);
+  for (unsigned i = 0; i < words.size(); i++)
+  {
+    entries[i * entry_size + PASS_LENGTH_OFFSET] = words[i].length();
+    copy(words[i].begin(), words[i].end(),
+         &entries[i * entry_size + PASS_PAYLOAD_OFFSET]);
+  }
+
+  // Hash on every device and compare with host
+  cl::Program program = buildProgram({ _self_test_kernel_source }, "");
+  unsigned num_failed = 0;
+
+  for (unsigned d = 0; d < _device.size(); d++)
+  {
+    vector<cl_uint> hashes(words.size());
+    cl::Buffer words_buffer { _context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                              entries.size(), entries.data() };
+    cl::Buffer hashes_buffer { _context, CL_MEM_WRITE_ONLY,
+                               hashes.size() * sizeof(cl_uint) };
+
+    cl::Kernel kernel { program, _self_test_kernel_name.c_str() };
+    kernel.setArg(0, words_buffer);
+    kernel.setArg(1, entry_size);
+    kernel.setArg(2, hashes_buffer);
+
+    _command_queue[d].enqueueNDRangeKernel(kernel, cl::NullRange,
+                                           cl::NDRange(words.size()),
+                                           cl::NullRange);
+    _command_queue[d].enqueueReadBuffer(hashes_buffer, CL_TRUE, 0,
+                                        hashes.size() * sizeof(cl_uint),
+                                        hashes.data());
+
+    for (unsigned i = 0; i < words.size(); i++)
+    {
+      cl_uint host_hash = HashTable::Hash(&entries[i * entry_size
+          + PASS_PAYLOAD_OFFSET], words[i].length());
+
+      if (hashes[i] != host_hash)
+      {
+        cout << "Device " << d << ": hash mismatch for word " << i << "\n";
+        num_failed++;
+      }
+    }
+  }
+
+  // Every word must be found in serialized table on host, in both layouts
+  for (bool perfect_hash : { false, true })
+  {
+    HashTable hash_table { 0.875, MIN_PASS_LENGTH, MAX_PASS_LENGTH,
+                           _self_test_bloom_bits, perfect_hash };
+    for (auto & word : words)
+      hash_table.Insert(word);
+
+    cl_uchar *flat_hash_table;
+    hash_table.Serialize(&flat_hash_table);
+
+    for (unsigned i = 0; i < words.size(); i++)
+    {
+      if (HashTable::Find(flat_hash_table, &entries[i * entry_size
+          + PASS_PAYLOAD_OFFSET], words[i].length()) == nullptr)
+      {
+        cout << "Word " << i << " not found in "
+             << (perfect_hash ? "perfect " : "") << "hash table\n";
+        num_failed++;
+      }
+    }
+    HashTable::Free(flat_hash_table);
+  }
+
+  cout << "Self-test " << (num_failed == 0 ? "passed" : "failed") << "\n";
+  return (num_failed == 0);
+}
+
 void Runner::Details()
 {
 }
@@ -244,6 +542,21 @@ void Runner::parseOptions(Options& options)
   stringstream ss;
   string substr;
 
+  // Parse backend
+  if (options.backend == "opencl")
+    _cpu_backend = false;
+  else if (options.backend == "cpu")
+    _cpu_backend = true;
+  else
+    throw invalid_argument("Invalid value for argument 'backend'");
+
+  if (_pipeline_depth == 0)
+    throw invalid_argument("Invalid value for argument 'pipeline-depth'");
+
+  _num_threads = options.threads;
+  if (_num_threads == 0)
+    _num_threads = max(thread::hardware_concurrency(), 1u);
+
   ss << options.devices;
 
   std::getline(ss, substr, ':');
@@ -34,10 +34,6 @@
 #include "CLMarkovPassGen.h"
 #include "Cracker.h"
 
-#define PASS_EXTRA_BYTES 1
-#define PASS_PAYLOAD_OFFSET 1
-#define PASS_LENGTH_OFFSET 0
-
 #define FLAG_RUN 0
 #define FLAG_END 1
 
@@ -49,6 +45,14 @@ public:
     unsigned gws = 1024000;
     std::string devices = "0";
     bool verbose = false;
+    bool analytic = false;
+    bool fused = false;
+    bool persistent = false;
+    bool generic_kernels = false;
+    std::string backend = "opencl";
+    unsigned threads = 0;
+    unsigned pipeline_depth = 2;
+    bool self_test = false;
   };
 
   Runner(Options & options);
@@ -59,6 +63,12 @@ public:
    */
   void Run();
 
+  /**
+   * Check that hashes of dictionary words on host and on all devices agree
+   * @return TRUE if the test passed
+   */
+  bool SelfTest();
+
   /**
    * Print detailed informations about experiment
    */
@@ -70,6 +80,16 @@ private:
 
   unsigned _gws;
   bool _verbose;
+  bool _analytic;
+  bool _fused;
+  bool _persistent;
+  bool _generic_kernels;
+  bool _cpu_backend;
+  unsigned _num_threads;
+  /**
+   * Number of batches in flight on every device
+   */
+  unsigned _pipeline_depth;
   unsigned _selected_platform;
   std::vector<unsigned> _selected_device;
 
@@ -77,16 +97,48 @@ private:
   std::vector<cl::CommandQueue> _command_queue;
   std::vector<cl::Kernel> _passgen_kernel;
   std::vector<cl::Kernel> _cracker_kernel;
+  std::vector<cl::Kernel> _fused_kernel;
   std::vector<cl::Device> _device;
 
-  cl_uint _passwords_entry_size;
-  std::vector<cl::Buffer> _passwords_buffer;
+  /**
+   * Password buffers of every device, one for each batch in flight
+   */
+  std::vector<std::vector<cl::Buffer>> _passwords_buffer;
+  /**
+   * Chunk counters of persistent kernels, one for each batch in flight
+   */
+  std::vector<std::vector<cl::Buffer>> _chunk_counter_buffer;
+  std::vector<std::size_t> _persistent_global_size;
+  std::vector<std::size_t> _persistent_local_size;
+
+  /**
+   * Number of passwords generated at once by single host thread
+   */
+  const unsigned _host_batch_size = 4096;
+
+  const std::string _kernel_directory = "kernels";
+  const std::string _self_test_kernel_name = "hashWords";
+  const std::string _self_test_kernel_source = "kernels/Cracker.cl";
+  const unsigned _self_test_bloom_bits = 10;
+  const std::string _fused_kernel_name = "markovCracker";
+  const std::string _fused_kernel_source = "kernels/Fused.cl";
+  const std::string _persistent_kernel_name = "markovCrackerPersistent";
+  /**
+   * Number of persistent work-groups launched per compute unit
+   */
+  const unsigned _persistent_groups_per_unit = 4;
 
   void createContext();
+  cl::Program buildProgram(const std::vector<std::string> & source_files,
+                           const std::string & options);
   void initGenerator();
   void initCracker();
+  void initFused();
+  void initHost();
 
   void runThread(unsigned device_number);
+  void runAnalytic();
+  void runHostThread(unsigned thread_number);
 
   void parseOptions(Options & options);
 };
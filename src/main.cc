@@ -42,31 +42,76 @@ struct Options : Runner::Options
   bool list_platforms = false;
 };
 
-const char * help_msg = "clMarkovGen [OPTIONS]\n\n"
+const char * help_msg = "clMarkovGen [OPTIONS]\n"
+    "clMarkovGen [OPTIONS] index FILE\n"
+    "         - write hash table of dictionary into index FILE, which can be\n"
+    "           used instead of the dictionary in later runs\n\n"
 		"Informations:\n"
 		"   -h, --help              display this help and exit\n"
 		"   -v, --verbose           enable verbose mode\n"
     "   --list-platforms        display all available OpenCL platforms\n"
+    "   --self-test             check that host and devices compute the same\n"
+    "                           hashes of dictionary words\n"
     "Common:\n"
     "   -D, --devices=platform[:device[,device]]\n"
     "         - platform - platform number (default 0),\n"
     "         - device - device number (default all available devices)\n"
-    "   -g, --gws               global work size for all devices (default 1024000)\n"
+    "   -g, --gws               global work size for all devices (default 1024000),\n"
+    "                           separate kernels fit that many records of\n"
+    "                           the longest passwords into their buffer and\n"
+    "                           generate more shorter ones per launch\n"
+    "   --backend=type          backend used for experiments:\n"
+    "         - opencl - OpenCL devices (default)\n"
+    "         - cpu - native threads, no OpenCL platform needed\n"
+    "   --threads=N             number of threads for cpu backend\n"
+    "                           (default all cores)\n"
+    "   --pipeline-depth=N      number of batches in flight on every device\n"
+    "                           (default 2)\n"
+    "   --fused                 generate and look up passwords in single kernel\n"
+    "   --persistent            fused kernel with fixed number of work-groups\n"
+    "                           pulling work from device-side counter\n"
+    "   --generic-kernels       don't bake run parameters into kernels\n"
     "Experiments:\n"
 		"   -d, --dictionary        dictionary with passwords for evaluation\n"
-    "   --load-factor           maximal load factor for the hash table (default 1) \n"
+    "                           (may be gzip compressed) or its index\n"
+    "   --load-factor           maximal load factor for the hash table\n"
+    "                           (default and maximum 0.875, not allowed\n"
+    "                           with index)\n"
+    "   --bloom-bits=N          bits of Bloom filter per dictionary word,\n"
+    "                           filter is kept in local memory (default 0,\n"
+    "                           off, not allowed with index)\n"
+    "   --perfect-hash          look up passwords by minimal perfect hash\n"
+    "                           of the dictionary (load factor is ignored,\n"
+    "                           not allowed with index)\n"
+    "   --shards=N              split dictionary by hash into N tables, every\n"
+    "                           device holds one of them and generates the\n"
+    "                           whole keyspace with devices of its shard\n"
+    "                           (default 1, index keeps its own value)\n"
+    "   --guess-curve=FILE      write number of cracked passwords after every\n"
+    "                           successful guess into CSV FILE\n"
     "   -p, --print             print cracked passwords\n"
+    "   -a, --analytic          evaluate dictionary analytically on host instead\n"
+    "                           of generating the whole keyspace\n"
 		"Generator:\n"
 		"   -s, --statistics        file with statistics for a Markov model\n"
 		"   -t, --thresholds=glob[:pos]\n"
 		"                           number of characters per position\n"
 		"         - glob - global value for every position in password\n"
     "         - pos - positional comma-separated values(overwrites global value)\n"
+    "   --sweep=t1,t2,...       evaluate several global thresholds in one run\n"
+    "                           (replaces global value of --thresholds)\n"
 		"   -l, --length=min:max    length of password (default 1:50)\n"
+    "   --per-item=K            number of passwords generated by one work-item\n"
+    "                           (default 1)\n"
+    "   --prefix-major          enumerate passwords with the last position\n"
+    "                           varying fastest, neighbouring work-items share\n"
+    "                           prefix (guess numbers differ from default order)\n"
 		"   -m, --mask              mask\n"
     "   -M, --model             type of Markov model:\n"
     "         - classic - First-order Markov model (default)\n"
-    "         - layered - Layered Markov model\n";
+    "         - layered - Layered Markov model\n"
+    "   --model-cache=dir       directory for reusing built Markov tables\n"
+    "                           between runs\n";
 
 const struct option long_options[] =
 {
@@ -80,9 +125,25 @@ const struct option long_options[] =
 	{"length", required_argument, 0, 'l'},
 	{"mask", required_argument, 0, 'm'},
 	{"print", no_argument, 0, 'p'},
+	{"analytic", no_argument, 0, 'a'},
 	{"model", required_argument, 0, 'M'},
 	{"list-platforms", no_argument, 0, 2},
 	{"load-factor", required_argument, 0, 3},
+	{"sweep", required_argument, 0, 4},
+	{"per-item", required_argument, 0, 5},
+	{"fused", no_argument, 0, 6},
+	{"generic-kernels", no_argument, 0, 7},
+	{"backend", required_argument, 0, 8},
+	{"threads", required_argument, 0, 9},
+	{"pipeline-depth", required_argument, 0, 10},
+	{"persistent", no_argument, 0, 11},
+	{"model-cache", required_argument, 0, 12},
+	{"self-test", no_argument, 0, 13},
+	{"bloom-bits", required_argument, 0, 14},
+	{"perfect-hash", no_argument, 0, 15},
+	{"shards", required_argument, 0, 16},
+	{"guess-curve", required_argument, 0, 17},
+	{"prefix-major", no_argument, 0, 18},
 	{0,0,0,0}
 };
 
@@ -93,7 +154,7 @@ int main(int argc, char *argv[])
   Options options;
   int opt, option_index;
 
-  while ((opt = getopt_long(argc, argv, "hvg:d:s:t:l:m:pD:M:", long_options,
+  while ((opt = getopt_long(argc, argv, "hvg:d:s:t:l:m:paD:M:", long_options,
                             &option_index)) != -1)
   {
     switch (opt)
@@ -107,6 +168,51 @@ int main(int argc, char *argv[])
       case 3:
         options.max_load_factor = atof(optarg);
         break;
+      case 4:
+        options.sweep = optarg;
+        break;
+      case 5:
+        options.per_item = atoi(optarg);
+        break;
+      case 6:
+        options.fused = true;
+        break;
+      case 7:
+        options.generic_kernels = true;
+        break;
+      case 8:
+        options.backend = optarg;
+        break;
+      case 9:
+        options.threads = atoi(optarg);
+        break;
+      case 10:
+        options.pipeline_depth = atoi(optarg);
+        break;
+      case 11:
+        options.persistent = true;
+        break;
+      case 12:
+        options.model_cache = optarg;
+        break;
+      case 13:
+        options.self_test = true;
+        break;
+      case 14:
+        options.bloom_bits = atoi(optarg);
+        break;
+      case 15:
+        options.perfect_hash = true;
+        break;
+      case 16:
+        options.shards = atoi(optarg);
+        break;
+      case 17:
+        options.guess_curve = optarg;
+        break;
+      case 18:
+        options.prefix_major = true;
+        break;
       case 'h':
         options.help = true;
         break;
@@ -134,6 +240,9 @@ int main(int argc, char *argv[])
       case 'p':
         options.print_passwords = true;
         break;
+      case 'a':
+        options.analytic = true;
+        break;
       case 'D':
         options.devices = optarg;
         break;
@@ -167,7 +276,22 @@ int main(int argc, char *argv[])
     return(1);
   }
 
-  if (options.stat_file.empty() || options.dictionary.empty())
+  // Index needs only dictionary and options of hash table
+  if (optind < argc && string { argv[optind] } == "index")
+  {
+    if (optind + 2 != argc || options.dictionary.empty())
+    {
+      cout << help_msg;
+      return (2);
+    }
+
+    Cracker cracker { options };
+    cracker.StoreIndex(argv[optind + 1]);
+    return (0);
+  }
+
+  if (!options.self_test
+      && (options.stat_file.empty() || options.dictionary.empty()))
   {
     cout << help_msg;
     return (2);
@@ -177,6 +301,10 @@ int main(int argc, char *argv[])
   try
   {
     Runner runner { options };
+
+    if (options.self_test)
+      return (runner.SelfTest() ? 0 : 1);
+
     runner.Run();
   }
   catch (cl::Error &e)